@@ -13,7 +13,39 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <queue>
+#include <array>
+#include <chrono>
 #include <limits>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <functional>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <cstdio>
+#include <charconv>
+#include <string_view>
+#include <cctype>
+#include <csignal>
+#include <cerrno>
+#include <future>
+#include <filesystem>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 using namespace std;
 
 // ================== COLOR CODING ==================
@@ -40,71 +72,784 @@ struct Criminal {
     vector<int> accomplices;
 };
 
+// Non-owning view over contiguous minutiae (a vector or a mapped gallery region)
+struct MinutiaeSpan {
+    const Minutiae* first = nullptr;
+    size_t count = 0;
+
+    MinutiaeSpan() {}
+    MinutiaeSpan(const Minutiae* data, size_t n) : first(data), count(n) {}
+    MinutiaeSpan(const vector<Minutiae>& v) : first(v.data()), count(v.size()) {}
+
+    const Minutiae* begin() const { return first; }
+    const Minutiae* end() const { return first + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const Minutiae& operator[](size_t i) const { return first[i]; }
+};
+
+// Non-owning view over contiguous accomplice IDs
+struct IdSpan {
+    const int* first = nullptr;
+    size_t count = 0;
+
+    IdSpan() {}
+    IdSpan(const int* data, size_t n) : first(data), count(n) {}
+    IdSpan(const vector<int>& v) : first(v.data()), count(v.size()) {}
+
+    const int* begin() const { return first; }
+    const int* end() const { return first + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    int operator[](size_t i) const { return first[i]; }
+};
+
+// Compact zone descriptor; gallery templates keep theirs precomputed
 struct Zone {
-    vector<Minutiae> minutiae;
-    double avgOrientation;
     int x_center, y_center;
+    double avgOrientation;
+    int count;
+};
+
+// Gallery copy of a Zone, 16 bytes instead of 24: the orientation is stored
+// in single precision
+struct PackedZone {
+    int32_t x_center, y_center;
+    float avgOrientation;
+    int32_t count;
 };
 
 // ================== GLOBAL VARIABLES ==================
-map<int, Criminal> criminalDB;
-unordered_map<int, vector<int>> accompliceGraph;
 const int ZONE_SIZE = 100;
 const int MAX_ZONES = 10;
 
 string databaseFile = "project\\criminal_database.txt";
+string galleryFile = "project\\criminal_database.bin";
+string journalFile = "project\\criminal_database.journal";
+string tripletIndexFile = "project\\criminal_database.tidx";
+string dedupCheckpointFile = "project\\criminal_database.dedup";
+string socketFile = "project\\fingerprint.sock";
 string credentialsFile = "project\\credentials.txt";
 string logFile = "project\\logs.txt";
 string historyFile = "project\\search_history.txt";
+string statsFile = "project\\stats.txt";
+
+// ================== INSTRUMENTATION ==================
+// Per-thread counters and timers for the hot paths. Build with
+// -DFINGERPRINT_NO_STATS to compile every probe point out.
+enum StatCounter {
+    COUNTER_CANDIDATES_SCORED,
+    COUNTER_CANDIDATES_PRUNED,
+    COUNTER_MINUTIAE_PAIRS,
+    COUNTER_GALLERY_VERSIONS,
+    COUNTER_GALLERY_COPIES,
+    COUNTER_COUNT
+};
+
+enum StatTimerId {
+    TIMER_GALLERY_LOAD,
+    TIMER_ZONES,
+    TIMER_SCORING,        // one sample per scored gallery chunk
+    TIMER_LOG_WRITE,      // enqueue cost seen by the caller
+    TIMER_HISTORY_WRITE,
+    TIMER_LOG_BATCH,      // background writer, one sample per batch
+    TIMER_GALLERY_UPDATE, // one sample per published gallery version
+    TIMER_COUNT
+};
+
+const char* const COUNTER_NAMES[COUNTER_COUNT] = {
+    "Candidates scored", "Candidates pruned", "Minutiae pairs evaluated", "Gallery versions",
+    "Full gallery copies"
+};
+const char* const TIMER_NAMES[TIMER_COUNT] = {
+    "Gallery load", "Zone construction", "Candidate scoring", "Log enqueue", "History enqueue",
+    "Log batch writes", "Gallery update"
+};
+
+const int STAT_METHODS = 4;          // indexed by MatchMethod - 1
+const int LATENCY_BUCKETS = 28;      // bucket b holds [2^b, 2^(b+1)) microseconds
+const size_t SLOW_QUERIES = 10;
+
+// Each thread writes only its own shard, so updates are plain relaxed
+// load/store pairs; readers sum the shards.
+struct alignas(64) StatShard {
+    atomic<uint64_t> counters[COUNTER_COUNT] = {};
+    atomic<uint64_t> timerCalls[TIMER_COUNT] = {};
+    atomic<uint64_t> timerNanos[TIMER_COUNT] = {};
+    atomic<uint64_t> latency[STAT_METHODS][LATENCY_BUCKETS] = {};
+
+    static void bump(atomic<uint64_t>& value, uint64_t n) {
+        value.store(value.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+};
+
+struct SlowQuery {
+    double ms;
+    int method;
+    size_t probeMinutiae;
+    size_t gallerySize;
+    time_t when;
+};
+
+mutex statLock;
+vector<unique_ptr<StatShard>> statShards;   // shards outlive their threads
+vector<SlowQuery> slowQueries;              // slowest first
+uint64_t latencyMaxMicros[STAT_METHODS] = {};
+
+StatShard& statShard() {
+    thread_local StatShard* shard = nullptr;
+    if (!shard) {
+        lock_guard<mutex> lock(statLock);
+        statShards.emplace_back(new StatShard());
+        shard = statShards.back().get();
+    }
+    return *shard;
+}
+
+class StatTimer {
+public:
+    explicit StatTimer(StatTimerId id) : id(id), start(chrono::steady_clock::now()) {}
+    ~StatTimer() {
+        StatShard& shard = statShard();
+        StatShard::bump(shard.timerCalls[id], 1);
+        StatShard::bump(shard.timerNanos[id], chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now() - start).count());
+    }
+
+private:
+    StatTimerId id;
+    chrono::steady_clock::time_point start;
+};
+
+void recordQuery(int method, double micros, size_t probeMinutiae, size_t gallerySize) {
+    int m = max(0, min(STAT_METHODS - 1, method - 1));
+    int bucket = 0;
+    for (uint64_t v = (uint64_t)micros; v > 1 && bucket < LATENCY_BUCKETS - 1; v >>= 1) bucket++;
+    StatShard::bump(statShard().latency[m][bucket], 1);
+
+    lock_guard<mutex> lock(statLock);
+    latencyMaxMicros[m] = max(latencyMaxMicros[m], (uint64_t)micros);
+    SlowQuery q = {micros / 1000, method, probeMinutiae, gallerySize, time(nullptr)};
+    if (slowQueries.size() == SLOW_QUERIES && slowQueries.back().ms >= q.ms) return;
+    if (slowQueries.size() == SLOW_QUERIES) slowQueries.pop_back();
+    slowQueries.insert(upper_bound(slowQueries.begin(), slowQueries.end(), q,
+        [](const SlowQuery& a, const SlowQuery& b) { return a.ms > b.ms; }), q);
+}
+
+// Times one search from construction to destruction
+class QueryTimer {
+public:
+    QueryTimer(int method, size_t probeMinutiae, size_t gallerySize)
+        : method(method), probeMinutiae(probeMinutiae), gallerySize(gallerySize),
+          start(chrono::steady_clock::now()) {}
+    ~QueryTimer() {
+        recordQuery(method, chrono::duration<double, micro>(chrono::steady_clock::now() - start).count(),
+                    probeMinutiae, gallerySize);
+    }
+
+private:
+    int method;
+    size_t probeMinutiae;
+    size_t gallerySize;
+    chrono::steady_clock::time_point start;
+};
+
+#ifndef FINGERPRINT_NO_STATS
+#define STAT_ADD(counter, n) StatShard::bump(statShard().counters[counter], (n))
+#define STAT_CONCAT_(a, b) a##b
+#define STAT_CONCAT(a, b) STAT_CONCAT_(a, b)
+#define STAT_TIMER(id) StatTimer STAT_CONCAT(statTimer, __LINE__)(id)
+#define STAT_QUERY(method, probeMinutiae, gallerySize) \
+    QueryTimer STAT_CONCAT(queryTimer, __LINE__)(method, probeMinutiae, gallerySize)
+#else
+#define STAT_ADD(counter, n) ((void)(n))
+#define STAT_TIMER(id) ((void)0)
+#define STAT_QUERY(method, probeMinutiae, gallerySize) ((void)0)
+#endif
+
+struct StatSnapshot {
+    uint64_t counters[COUNTER_COUNT] = {};
+    uint64_t timerCalls[TIMER_COUNT] = {};
+    uint64_t timerNanos[TIMER_COUNT] = {};
+    uint64_t latency[STAT_METHODS][LATENCY_BUCKETS] = {};
+    uint64_t latencyMax[STAT_METHODS] = {};
+    vector<SlowQuery> slowest;
+};
+
+StatSnapshot statSnapshot() {
+    StatSnapshot s;
+    lock_guard<mutex> lock(statLock);
+    for (const auto& shard : statShards) {
+        for (int c = 0; c < COUNTER_COUNT; ++c) s.counters[c] += shard->counters[c].load(memory_order_relaxed);
+        for (int t = 0; t < TIMER_COUNT; ++t) {
+            s.timerCalls[t] += shard->timerCalls[t].load(memory_order_relaxed);
+            s.timerNanos[t] += shard->timerNanos[t].load(memory_order_relaxed);
+        }
+        for (int m = 0; m < STAT_METHODS; ++m)
+            for (int b = 0; b < LATENCY_BUCKETS; ++b)
+                s.latency[m][b] += shard->latency[m][b].load(memory_order_relaxed);
+    }
+    for (int m = 0; m < STAT_METHODS; ++m) s.latencyMax[m] = latencyMaxMicros[m];
+    s.slowest = slowQueries;
+    return s;
+}
+
+// Upper edge (in ms) of the bucket holding the given quantile
+double latencyQuantile(const uint64_t* buckets, double q) {
+    uint64_t total = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; ++b) total += buckets[b];
+    if (total == 0) return 0;
+    uint64_t rank = (uint64_t)ceil(q * total), seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; ++b) {
+        seen += buckets[b];
+        if (seen >= rank) return (double)(2ULL << b) / 1000;
+    }
+    return (double)(2ULL << (LATENCY_BUCKETS - 1)) / 1000;
+}
+
+// ================== AUDIT LOGGER ==================
+// logAction() and addToSearchHistory() only format a record and push it onto a
+// lock-free queue; a background thread appends batches of records to files
+// that stay open and applies the fsync policy.
+//
+// Each log is a run of numbered segments (logs.000001.log, logs.000002.log,
+// ...); a new one is started once the current one passes logMaxBytes. A record
+// is one line:
+//   unix time \t user \t action \t criminal ID or - \t detail
+// The writer never lets times go backwards within a log. Next to each segment
+// a sparse index (.idx) holds the time and offset of the first record written
+// after the segment is opened and of one record every LOG_INDEX_STRIDE bytes,
+// so time-range queries skip whole segments and read only part of the rest.
+enum LogTarget { LOG_ACTIONS, LOG_HISTORY, LOG_TARGETS };
+
+enum LogFsync {
+    LOG_FSYNC_NEVER,      // leave it to the OS
+    LOG_FSYNC_BATCH,      // after every batch written
+    LOG_FSYNC_INTERVAL    // at most once per LOG_FSYNC_PERIOD
+};
+
+LogFsync logFsync = LOG_FSYNC_INTERVAL;
+uint64_t logMaxBytes = 16 << 20;   // start a new segment past this size (0 = never)
+int logKeepSegments = 0;           // older segments are deleted beyond this many (0 = keep all)
+const uint64_t LOG_INDEX_STRIDE = 64 << 10;
+const auto LOG_FSYNC_PERIOD = chrono::seconds(1);
+const auto LOG_IDLE_WAIT = chrono::milliseconds(200);
+const int NO_CRIMINAL = INT_MIN;
+
+// Who actions are logged for; set by each login
+string sessionUser;
+
+struct LogIndexEntry {
+    int64_t time;
+    uint64_t offset;
+};
+
+struct LogSegment {
+    uint64_t number;
+    string data, index;
+};
+
+struct AuditEntry {
+    int64_t time = 0;
+    string user, action;
+    int criminal = NO_CRIMINAL;
+    string detail;
+};
+
+const string& logPath(int target) { return target == LOG_ACTIONS ? logFile : historyFile; }
+
+// logs.txt -> logs; segment names replace the extension
+string logStem(const string& path) {
+    size_t dot = path.find_last_of('.');
+    size_t separator = path.find_last_of("/\\");
+    if (dot == string::npos || (separator != string::npos && dot < separator)) return path;
+    return path.substr(0, dot);
+}
+
+string logSegmentPath(const string& path, uint64_t number, const char* suffix) {
+    char digits[24];
+    snprintf(digits, sizeof(digits), ".%06llu", (unsigned long long)number);
+    return logStem(path) + digits + suffix;
+}
+
+// The log's segments, oldest first
+vector<LogSegment> logSegments(const string& path) {
+    filesystem::path stem(logStem(path));
+    filesystem::path dir = stem.has_parent_path() ? stem.parent_path() : filesystem::path(".");
+    string prefix = stem.filename().string() + ".";
+    vector<LogSegment> segments;
+    error_code ec;
+    for (filesystem::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        string name = it->path().filename().string();
+        if (name.size() <= prefix.size() + 4 || name.compare(0, prefix.size(), prefix) != 0 ||
+            name.compare(name.size() - 4, 4, ".log") != 0)
+            continue;
+        string digits = name.substr(prefix.size(), name.size() - prefix.size() - 4);
+        if (digits.find_first_not_of("0123456789") != string::npos) continue;
+        uint64_t number = strtoull(digits.c_str(), nullptr, 10);
+        segments.push_back(LogSegment{number, logSegmentPath(path, number, ".log"), logSegmentPath(path, number, ".idx")});
+    }
+    sort(segments.begin(), segments.end(), [](const LogSegment& a, const LogSegment& b) { return a.number < b.number; });
+    return segments;
+}
+
+vector<LogIndexEntry> readLogIndex(const string& path, size_t limit = SIZE_MAX) {
+    vector<LogIndexEntry> entries;
+    ifstream fin(path, ios::binary);
+    LogIndexEntry entry;
+    while (entries.size() < limit && fin.read(reinterpret_cast<char*>(&entry), sizeof(entry))) entries.push_back(entry);
+    return entries;
+}
+
+bool parseAuditEntry(string_view line, AuditEntry& e) {
+    string_view fields[5];
+    for (int i = 0; i < 4; ++i) {
+        size_t tab = line.find('\t');
+        if (tab == string_view::npos) return false;
+        fields[i] = line.substr(0, tab);
+        line.remove_prefix(tab + 1);
+    }
+    fields[4] = line;
+    if (from_chars(fields[0].data(), fields[0].data() + fields[0].size(), e.time).ec != errc()) return false;
+    e.criminal = NO_CRIMINAL;
+    if (fields[3] != "-" &&
+        from_chars(fields[3].data(), fields[3].data() + fields[3].size(), e.criminal).ec != errc())
+        return false;
+    e.user.assign(fields[1]);
+    e.action.assign(fields[2]);
+    e.detail.assign(fields[4]);
+    return true;
+}
+
+// Calls `visit` for each complete, well-formed line of data[begin, end)
+template <typename Visit>
+uint64_t scanLogSegment(const string& data, uint64_t begin, uint64_t end, Visit visit) {
+    ifstream fin(data, ios::binary);
+    if (!fin) return 0;
+    fin.seekg(0, ios::end);
+    uint64_t size = fin.tellg();
+    end = min(end, size);
+    if (begin >= end) return 0;
+    string buffer(end - begin, '\0');
+    fin.seekg(begin);
+    fin.read(&buffer[0], buffer.size());
+    buffer.resize(fin.gcount());
+    AuditEntry entry;
+    size_t pos = 0;
+    for (size_t eol; (eol = buffer.find('\n', pos)) != string::npos; pos = eol + 1)
+        if (parseAuditEntry(string_view(buffer).substr(pos, eol - pos), entry)) visit(entry);
+    return buffer.size();
+}
+
+// The time of a segment's last record, read from its last indexed record on
+// (INT64_MIN when it has none). `terminated` is false after a torn last line.
+int64_t lastLogTime(const LogSegment& segment, bool& terminated) {
+    vector<LogIndexEntry> index = readLogIndex(segment.index);
+    int64_t last = index.empty() ? INT64_MIN : index.back().time;
+    scanLogSegment(segment.data, index.empty() ? 0 : index.back().offset, UINT64_MAX,
+                   [&](const AuditEntry& e) { last = max(last, e.time); });
+    ifstream fin(segment.data, ios::binary | ios::ate);
+    terminated = true;
+    if (fin && fin.tellg() > 0) {
+        fin.seekg(-1, ios::end);
+        terminated = fin.get() == '\n';
+    }
+    return last;
+}
+
+struct LogRecord {
+    atomic<LogRecord*> next{nullptr};
+    LogTarget target = LOG_ACTIONS;
+    int64_t time = 0;
+    string line;     // the record after its time
+};
+
+// Intrusive multi-producer/single-consumer queue (Vyukov). push() is one
+// atomic exchange; only the writer thread pops.
+class LogQueue {
+public:
+    LogQueue() : head(&stub), tail(&stub) {}
+
+    void push(LogRecord* record) {
+        record->next.store(nullptr, memory_order_relaxed);
+        LogRecord* prev = head.exchange(record, memory_order_acq_rel);
+        prev->next.store(record, memory_order_release);
+    }
+
+    // Returns nullptr when empty or when a producer is halfway through push()
+    LogRecord* pop() {
+        LogRecord* t = tail;
+        LogRecord* next = t->next.load(memory_order_acquire);
+        if (t == &stub) {
+            if (!next) return nullptr;
+            tail = next;
+            t = next;
+            next = next->next.load(memory_order_acquire);
+        }
+        if (next) {
+            tail = next;
+            return t;
+        }
+        if (t != head.load(memory_order_acquire)) return nullptr;
+        push(&stub);
+        next = t->next.load(memory_order_acquire);
+        if (!next) return nullptr;
+        tail = next;
+        return t;
+    }
+
+    bool empty() const { return tail == &stub && head.load(memory_order_acquire) == &stub; }
+
+private:
+    atomic<LogRecord*> head;
+    LogRecord* tail;
+    LogRecord stub;
+};
+
+
+class AuditLogger {
+public:
+    ~AuditLogger() { stop(); }
+
+    void write(LogTarget target, string line) {
+        LogRecord* record = new LogRecord();
+        record->target = target;
+        record->time = time(0);
+        record->line = move(line);
+        if (!running.load()) start();
+        enqueued.fetch_add(1);
+        queue.push(record);
+        if (sleeping.load()) {
+            lock_guard<mutex> lock(wakeLock);
+            wake.notify_one();
+        }
+    }
+
+    // Blocks until everything enqueued so far is in the files
+    void flush() {
+        uint64_t target = enqueued.load();
+        unique_lock<mutex> lock(wakeLock);
+        if (written >= target) return;
+        wake.notify_one();
+        drained.wait(lock, [&] { return written >= target; });
+    }
+
+    // Drains the queue and closes the files; a later write starts a new writer
+    void stop() {
+        lock_guard<mutex> serial(startLock);
+        if (!running.load()) return;
+        {
+            lock_guard<mutex> lock(wakeLock);
+            stopping = true;
+        }
+        wake.notify_one();
+        writer.join();
+        stopping = false;
+        running.store(false);
+    }
+
+private:
+    void start() {
+        lock_guard<mutex> serial(startLock);
+        if (running.load()) return;
+        writer = thread(&AuditLogger::writerLoop, this);
+        running.store(true);
+    }
+
+    struct LogFile {
+        FILE* out = nullptr;
+        FILE* index = nullptr;
+        uint64_t number = 0;             // segment being written
+        uint64_t bytes = 0;
+        uint64_t indexed = 0;            // offset of the last indexed record
+        bool reindex = false;            // index the next record
+        int64_t lastTime = INT64_MIN;
+        bool dirty = false;
+    };
+
+    // Continues the newest segment unless `number` names another
+    bool open(int target, uint64_t number = 0) {
+        LogFile& f = files[target];
+        const string& path = logPath(target);
+        if (number == 0) {
+            vector<LogSegment> segments = logSegments(path);
+            number = segments.empty() ? 1 : segments.back().number;
+        }
+        LogSegment segment{number, logSegmentPath(path, number, ".log"), logSegmentPath(path, number, ".idx")};
+        bool terminated;
+        f.lastTime = max(f.lastTime, lastLogTime(segment, terminated));
+        f.out = fopen(segment.data.c_str(), "ab");
+        f.index = fopen(segment.index.c_str(), "ab");
+        if (!f.out || !f.index) {
+            close(target);
+            return false;
+        }
+        if (!terminated) fputc('\n', f.out);
+        fseek(f.out, 0, SEEK_END);
+        f.number = number;
+        f.bytes = ftell(f.out);
+        f.reindex = true;
+        return true;
+    }
+
+    void close(int target) {
+        LogFile& f = files[target];
+        if (f.out) fclose(f.out);
+        if (f.index) fclose(f.index);
+        f.out = f.index = nullptr;
+    }
+
+    // Starts the next segment and drops the oldest past logKeepSegments
+    void rotate(int target) {
+        uint64_t next = files[target].number + 1;
+        close(target);
+        open(target, next);
+        if (logKeepSegments <= 0) return;
+        vector<LogSegment> segments = logSegments(logPath(target));
+        for (size_t i = 0; i + logKeepSegments < segments.size(); ++i) {
+            remove(segments[i].data.c_str());
+            remove(segments[i].index.c_str());
+        }
+    }
+
+    void sync() {
+        for (auto& f : files) {
+            if (!f.out || !f.dirty) continue;
+            fflush(f.out);
+            fflush(f.index);
+#ifndef _WIN32
+            fsync(fileno(f.out));
+            fsync(fileno(f.index));
+#endif
+            f.dirty = false;
+        }
+        lastSync = chrono::steady_clock::now();
+    }
+
+    size_t writeBatch() {
+        if (queue.empty()) return 0;
+        STAT_TIMER(TIMER_LOG_BATCH);
+        size_t count = 0;
+        while (LogRecord* record = queue.pop()) {
+            LogFile& f = files[record->target];
+            if (!f.out) open(record->target);
+            if (f.out) {
+                int64_t when = max(record->time, f.lastTime);
+                if (f.reindex || f.bytes - f.indexed >= LOG_INDEX_STRIDE) {
+                    LogIndexEntry entry{when, f.bytes};
+                    fwrite(&entry, sizeof(entry), 1, f.index);
+                    f.indexed = f.bytes;
+                    f.reindex = false;
+                }
+                char stamp[24];
+                char* end = to_chars(stamp, stamp + sizeof(stamp) - 1, when).ptr;
+                *end++ = '\t';
+                fwrite(stamp, 1, end - stamp, f.out);
+                fwrite(record->line.data(), 1, record->line.size(), f.out);
+                f.bytes += (end - stamp) + record->line.size();
+                f.lastTime = when;
+                f.dirty = true;
+                if (logMaxBytes && f.bytes >= logMaxBytes) rotate(record->target);
+            }
+            delete record;
+            count++;
+        }
+        // Records before the index entries that point at them
+        for (auto& f : files)
+            if (f.out) {
+                fflush(f.out);
+                fflush(f.index);
+            }
+        return count;
+    }
+
+    void writerLoop() {
+        lastSync = chrono::steady_clock::now();
+        while (true) {
+            size_t count = writeBatch();
+            if (logFsync == LOG_FSYNC_BATCH ||
+                (logFsync == LOG_FSYNC_INTERVAL && chrono::steady_clock::now() - lastSync >= LOG_FSYNC_PERIOD))
+                sync();
+
+            unique_lock<mutex> lock(wakeLock);
+            written += count;
+            drained.notify_all();
+            if (!queue.empty() || written < enqueued.load()) continue;
+            if (stopping) break;
+            sleeping.store(true);
+            if (queue.empty() && written >= enqueued.load())
+                wake.wait_for(lock, LOG_IDLE_WAIT);
+            sleeping.store(false);
+        }
+        if (logFsync != LOG_FSYNC_NEVER) sync();
+        for (int t = 0; t < LOG_TARGETS; ++t) close(t);
+    }
+
+    LogQueue queue;
+    LogFile files[LOG_TARGETS];
+    mutex startLock;
+    atomic<bool> running{false};
+    thread writer;
+    mutex wakeLock;
+    condition_variable wake, drained;
+    atomic<bool> sleeping{false};
+    atomic<uint64_t> enqueued{0};
+    uint64_t written = 0;     // guarded by wakeLock
+    bool stopping = false;    // guarded by wakeLock
+    chrono::steady_clock::time_point lastSync;
+};
+
+AuditLogger auditLog;
+
+// Tabs and line breaks would split a record; free text gets spaces instead
+string logField(string text) {
+    replace_if(text.begin(), text.end(), [](char c) { return c == '\t' || c == '\n' || c == '\r'; }, ' ');
+    return text;
+}
+
+// Everything after the time
+string logRecord(const string& action, int criminal, const string& detail) {
+    return logField(sessionUser) + "\t" + action + "\t" + (criminal == NO_CRIMINAL ? "-" : to_string(criminal)) +
+           "\t" + logField(detail) + "\n";
+}
+
+// ---- Queries ----
+// Bounds are [from, to) in unix time; empty strings and NO_CRIMINAL match anything.
+struct AuditQuery {
+    int64_t from = INT64_MIN, to = INT64_MAX;
+    string user, action;
+    int criminal = NO_CRIMINAL;
+
+    bool matches(const AuditEntry& e) const {
+        return e.time >= from && e.time < to && (user.empty() || e.user == user) &&
+               (action.empty() || e.action == action) && (criminal == NO_CRIMINAL || e.criminal == criminal);
+    }
+};
+
+struct AuditScan {
+    size_t segments = 0, segmentsRead = 0, matched = 0;
+    uint64_t bytesRead = 0;
+};
+
+// Calls `visit` with the log's matching records, oldest first. A segment is
+// skipped when the next one starts before `from` or it starts at or after
+// `to`; within the rest, the index bounds the bytes read.
+AuditScan queryAuditLog(int target, const AuditQuery& q, const function<void(const AuditEntry&)>& visit) {
+    auditLog.flush();
+    vector<LogSegment> segments = logSegments(logPath(target));
+    AuditScan scan;
+    scan.segments = segments.size();
+    // First indexed time of each segment; INT64_MIN when it has no index
+    vector<int64_t> starts(segments.size(), INT64_MIN);
+    for (size_t i = 0; i < segments.size(); ++i) {
+        vector<LogIndexEntry> first = readLogIndex(segments[i].index, 1);
+        if (!first.empty() && first[0].offset == 0) starts[i] = first[0].time;
+    }
+    for (size_t i = 0; i < segments.size(); ++i) {
+        if (starts[i] >= q.to) break;
+        if (i + 1 < segments.size() && starts[i + 1] != INT64_MIN && starts[i + 1] < q.from) continue;
+        uint64_t begin = 0, end = UINT64_MAX;
+        for (const LogIndexEntry& e : readLogIndex(segments[i].index)) {
+            if (e.time < q.from) begin = e.offset;
+            else if (e.time >= q.to) {
+                end = e.offset;
+                break;
+            }
+        }
+        scan.segmentsRead++;
+        scan.bytesRead += scanLogSegment(segments[i].data, begin, end, [&](const AuditEntry& e) {
+            if (!q.matches(e)) return;
+            scan.matched++;
+            visit(e);
+        });
+    }
+    return scan;
+}
+
+// "YYYY-MM-DD" or "YYYY-MM-DDTHH:MM[:SS]" in local time
+bool parseLogTime(const string& text, int64_t& out) {
+    tm t{};
+    int fields = sscanf(text.c_str(), "%d-%d-%dT%d:%d:%d", &t.tm_year, &t.tm_mon, &t.tm_mday, &t.tm_hour, &t.tm_min, &t.tm_sec);
+    if (fields != 3 && fields != 5 && fields != 6) return false;
+    if (t.tm_mon < 1 || t.tm_mon > 12 || t.tm_mday < 1 || t.tm_mday > 31 || t.tm_hour > 23 || t.tm_min > 59 || t.tm_sec > 60)
+        return false;
+    t.tm_year -= 1900;
+    t.tm_mon -= 1;
+    t.tm_isdst = -1;
+    time_t value = mktime(&t);
+    if (value == (time_t)-1) return false;
+    out = value;
+    return true;
+}
+
+string formatLogTime(int64_t value) {
+    time_t seconds = (time_t)value;
+    tm t{};
+#ifdef _WIN32
+    localtime_s(&t, &seconds);
+#else
+    localtime_r(&seconds, &t);
+#endif
+    char text[32];
+    strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &t);
+    return text;
+}
+
+string formatAuditEntry(const AuditEntry& e) {
+    return formatLogTime(e.time) + "  " + e.user + "  " + e.action +
+           (e.criminal == NO_CRIMINAL ? "" : "  " + to_string(e.criminal)) + (e.detail.empty() ? "" : "  " + e.detail);
+}
 
 // ================== UTILITY FUNCTIONS ==================
+// Status messages go here; non-interactive modes point it at stderr so that
+// stdout only carries their machine-readable output.
+ostream* statusOut = &cout;
+
 void printHeader(const string& title) {
     cout << COLOR_BOLD << COLOR_CYAN << "\n=== " << title << " ===" << COLOR_RESET << "\n";
 }
 
 void printSuccess(const string& message) {
-    cout << COLOR_GREEN << "[✓] " << message << COLOR_RESET << "\n";
+    *statusOut << COLOR_GREEN << "[✓] " << message << COLOR_RESET << "\n";
 }
 
 void printWarning(const string& message) {
-    cout << COLOR_YELLOW << "[!] " << message << COLOR_RESET << "\n";
+    *statusOut << COLOR_YELLOW << "[!] " << message << COLOR_RESET << "\n";
 }
 
 void printError(const string& message) {
-    cout << COLOR_RED << "[✗] " << message << COLOR_RESET << "\n";
+    *statusOut << COLOR_RED << "[✗] " << message << COLOR_RESET << "\n";
 }
 
 void printInfo(const string& message) {
-    cout << COLOR_BLUE << "[i] " << message << COLOR_RESET << "\n";
+    *statusOut << COLOR_BLUE << "[i] " << message << COLOR_RESET << "\n";
 }
 
-void logAction(const string& action) {
-    ofstream fout(logFile, ios::app);
-    time_t now = time(0);
-    fout << ctime(&now) << ": " << action << "\n";
-    fout.close();
+void logAction(const string& action, int criminal = NO_CRIMINAL, const string& detail = "") {
+    STAT_TIMER(TIMER_LOG_WRITE);
+    auditLog.write(LOG_ACTIONS, logRecord(action, criminal, detail));
 }
 
-void addToSearchHistory(const string& entry) {
-    ofstream fout(historyFile, ios::app);
-    time_t now = time(0);
-    fout << ctime(&now) << ": " << entry << "\n";
-    fout.close();
+void addToSearchHistory(const string& action, int criminal, const string& detail = "") {
+    STAT_TIMER(TIMER_HISTORY_WRITE);
+    auditLog.write(LOG_HISTORY, logRecord(action, criminal, detail));
 }
 
-void viewSearchHistory() {
-    ifstream fin(historyFile);
+// ================== AUTHENTICATION ==================
+bool checkCredentials(const string& user, const string& pass) {
+    ifstream fin(credentialsFile);
     string line;
-    printHeader("SEARCH HISTORY");
     while (getline(fin, line)) {
-        cout << line << "\n";
+        stringstream ss(line);
+        string u, p;
+        ss >> u >> p;
+        if (u == user && p == pass) return true;
     }
-    fin.close();
+    return false;
 }
 
-// ================== AUTHENTICATION ==================
 bool authenticate() {
-    string user, pass, line;
+    string user, pass;
     int attempts = 0;
 
     while (attempts < 3) {
@@ -113,26 +858,14 @@ bool authenticate() {
         cout << COLOR_BOLD << "Enter password: " << COLOR_RESET;
         cin >> pass;
 
-        ifstream fin(credentialsFile);
-        bool success = false;
-        while (getline(fin, line)) {
-            stringstream ss(line);
-            string u, p;
-            ss >> u >> p;
-            if (u == user && p == pass) {
-                success = true;
-                break;
-            }
-        }
-        fin.close();
-
-        if (success) {
+        sessionUser = user;
+        if (checkCredentials(user, pass)) {
             printSuccess("Login successful!");
-            logAction("Login successful for user: " + user);
+            logAction("login");
             return true;
         } else {
             printError("Invalid credentials. Try again.");
-            logAction("Failed login attempt for user: " + user);
+            logAction("login-failed");
             attempts++;
         }
     }
@@ -140,502 +873,5434 @@ bool authenticate() {
     return false;
 }
 
-// ================== DATABASE MANAGEMENT ==================
-void saveCriminalDB() {
-    ofstream fout(databaseFile);
-    for (auto it = criminalDB.begin(); it != criminalDB.end(); ++it) {
-        int id = it->first;
-        Criminal& crim = it->second;
-        fout << id << "|" << crim.name;
-        for (auto& m : crim.fingerprint)
-            fout << "|" << m.x << "|" << m.y << "|" << m.angle << "|" << m.type << "|" << m.orientation;
-        fout << "|AC";
-        for (int ac : crim.accomplices)
-            fout << "|" << ac;
-        fout << "\n";
-    }
-    fout.close();
+// ================== AUDIT QUERIES ==================
+// Reads one filter value; "-" leaves it open
+void readLogFilter(const string& prompt, string& value) {
+    cout << prompt << " (- for any): ";
+    cin >> value;
+    if (value == "-") value.clear();
 }
 
-void loadCriminalDB() {
-    criminalDB.clear();
-    ifstream fin(databaseFile);
-    string line;
-    
-    while (getline(fin, line)) {
-        stringstream ss(line);
-        Criminal c;
-        string token;
-        
-        getline(ss, token, '|');
-        try { c.id = stoi(token); } 
-        catch (...) { continue; }
-        
-        getline(ss, c.name, '|');
-        
-        while (getline(ss, token, '|')) {
-            if (token == "AC") break;
-            
-            try {
-                Minutiae m;
-                m.x = stoi(token);
-                getline(ss, token, '|'); m.y = stoi(token);
-                getline(ss, token, '|'); m.angle = stoi(token);
-                getline(ss, token, '|'); m.type = token[0];
-                getline(ss, token, '|'); m.orientation = stod(token);
-                c.fingerprint.push_back(m);
-            } catch (...) { break; }
-        }
-        
-        while (getline(ss, token, '|')) {
-            try { c.accomplices.push_back(stoi(token)); } 
-            catch (...) { break; }
-        }
-        
-        criminalDB[c.id] = c;
+// Parses the text filters into `q`, reporting the first bad one
+bool auditFilters(const string& from, const string& to, const string& criminal, AuditQuery& q) {
+    if ((!from.empty() && !parseLogTime(from, q.from)) || (!to.empty() && !parseLogTime(to, q.to))) {
+        printError("Times are YYYY-MM-DD or YYYY-MM-DDTHH:MM[:SS]");
+        return false;
     }
-    fin.close();
+    if (!criminal.empty() &&
+        from_chars(criminal.data(), criminal.data() + criminal.size(), q.criminal).ec != errc()) {
+        printError("Invalid criminal ID: " + criminal);
+        return false;
+    }
+    return true;
 }
 
-// ================== NETWORK VISUALIZATION ==================
-void buildAccompliceGraph() {
-    accompliceGraph.clear();
-     for (auto it = criminalDB.begin(); it != criminalDB.end(); ++it) {
-        int id = it->first;
-        Criminal& crim = it->second;
-        for (int accompliceId : crim.accomplices) {
-            accompliceGraph[id].push_back(accompliceId);
-            if (accompliceGraph.find(accompliceId) == accompliceGraph.end()) {
-                accompliceGraph[accompliceId] = vector<int>();
-            }
-        }
-    }
+void reportAuditScan(const AuditScan& scan) {
+    printInfo(to_string(scan.matched) + " entries (read " + to_string(scan.bytesRead) + " bytes from " +
+              to_string(scan.segmentsRead) + " of " + to_string(scan.segments) + " segments)");
 }
 
-void showAccompliceNetwork(int id) {
-    if (criminalDB.find(id) == criminalDB.end()) {
-        printError("Criminal not found in database!");
+void viewSearchHistory() {
+    printHeader("SEARCH HISTORY");
+    cout << "1. Search history\n";
+    cout << "2. Action log\n";
+    cout << "Your choice (1-2): ";
+    int choice;
+    if (!(cin >> choice) || (choice != 1 && choice != 2)) {
+        cin.clear();
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        printError("Invalid choice!");
         return;
     }
+    AuditQuery q;
+    string from, to, criminal;
+    readLogFilter("From (YYYY-MM-DD or YYYY-MM-DDTHH:MM)", from);
+    readLogFilter("Until, exclusive", to);
+    readLogFilter("User", q.user);
+    readLogFilter("Criminal ID", criminal);
+    if (!auditFilters(from, to, criminal, q)) return;
+    AuditScan scan = queryAuditLog(choice == 1 ? LOG_HISTORY : LOG_ACTIONS, q,
+                                   [](const AuditEntry& e) { cout << formatAuditEntry(e) << "\n"; });
+    reportAuditScan(scan);
+}
 
-    unordered_set<int> visited;
-    queue<int> q;
-    q.push(id);
-    visited.insert(id);
+// fingerprint --audit --user <name> [--log actions|history] [--from t] [--to t]
+//                     [--by user] [--action a] [--criminal id]
+// Prints the matching records of the action log (default) or the search
+// history, oldest first; the password is read from FP_PASSWORD.
+int runAudit(const vector<string>& args) {
+    string user, log = "actions", from, to, criminal;
+    AuditQuery q;
+    statusOut = &cerr;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "--user" && i + 1 < args.size()) user = args[++i];
+        else if (args[i] == "--log" && i + 1 < args.size()) log = args[++i];
+        else if (args[i] == "--from" && i + 1 < args.size()) from = args[++i];
+        else if (args[i] == "--to" && i + 1 < args.size()) to = args[++i];
+        else if (args[i] == "--by" && i + 1 < args.size()) q.user = args[++i];
+        else if (args[i] == "--action" && i + 1 < args.size()) q.action = args[++i];
+        else if (args[i] == "--criminal" && i + 1 < args.size()) criminal = args[++i];
+        else {
+            printError("Unknown audit option: " + args[i]);
+            return 1;
+        }
+    }
+    if (log != "actions" && log != "history") {
+        printError("Unknown log; use actions or history");
+        return 1;
+    }
+    if (!auditFilters(from, to, criminal, q)) return 1;
+    const char* password = getenv("FP_PASSWORD");
+    sessionUser = user;
+    if (user.empty() || !password || !checkCredentials(user, password)) {
+        printError("Audit mode needs --user and a valid FP_PASSWORD");
+        logAction("login-failed", NO_CRIMINAL, "audit");
+        return 1;
+    }
 
-    printHeader("FULL CRIMINAL NETWORK FOR #" + to_string(id) + " (" + criminalDB[id].name + ")");
-    cout << COLOR_MAGENTA << "Network shows all direct and indirect connections\n";
-    cout << "Format: [ID] Name (Connection Degree)\n" << COLOR_RESET;
+    AuditScan scan = queryAuditLog(log == "history" ? LOG_HISTORY : LOG_ACTIONS, q,
+                                   [](const AuditEntry& e) { cout << formatAuditEntry(e) << "\n"; });
+    reportAuditScan(scan);
+    string query;
+    for (size_t i = 1; i < args.size(); ++i)
+        if (args[i - 1] != "--user" && args[i] != "--user") query += (query.empty() ? "" : " ") + args[i];
+    logAction("audit", NO_CRIMINAL, query);
+    return 0;
+}
 
-    unordered_map<int, int> degrees;
-    degrees[id] = 0;
+// ================== RECORD STORE ==================
+// Criminal records are kept in flat arrays rather than one heap node each: a
+// slot table in ID order, arenas shared by every fingerprint and every
+// accomplice list, and a pool of interned names. An open-addressing table maps
+// an ID to its slot. Records are read through CriminalView, which stays valid
+// until the store is next modified.
+//
+// Appending an ID above the current maximum (every load, most enrollments) is
+// amortized O(1); inserting below it shifts the slot table and rebuilds the ID
+// table. Replacing a record appends its new data and leaves the old entries
+// dead until they make up half of an arena, which is then rebuilt.
+struct CriminalView {
+    int id;
+    string_view name;
+    MinutiaeSpan fingerprint;
+    IdSpan accomplices;
+};
 
-    while (!q.empty()) {
-        int current = q.front();
-        q.pop();
+class RecordStore {
+public:
+    static const size_t npos = SIZE_MAX;
 
-        cout << "\n" << COLOR_BOLD << "[" << current << "] " << criminalDB[current].name 
-             << COLOR_RESET << " (Degree: " << degrees[current] << ") connected to:\n";
+    struct const_iterator {
+        const RecordStore* store;
+        size_t slot;
 
-        if (accompliceGraph.find(current) != accompliceGraph.end()) {
-            for (int neighbor : accompliceGraph[current]) {
-                cout << "  -> [" << neighbor << "] " << criminalDB[neighbor].name;
-                if (degrees.find(neighbor) == degrees.end()) {
-                    degrees[neighbor] = degrees[current] + 1;
-                }
-                cout << " (Degree: " << degrees[neighbor] << ")\n";
-                
-                if (visited.find(neighbor) == visited.end()) {
-                    visited.insert(neighbor);
-                    q.push(neighbor);
-                }
-            }
+        CriminalView operator*() const { return store->view(slot); }
+        const_iterator& operator++() {
+            ++slot;
+            return *this;
+        }
+        bool operator!=(const const_iterator& other) const { return slot != other.slot; }
+    };
+
+    const_iterator begin() const { return const_iterator{this, 0}; }
+    const_iterator end() const { return const_iterator{this, slots.size()}; }
+    size_t size() const { return slots.size(); }
+    bool empty() const { return slots.empty(); }
+    size_t minutiaeCount() const { return minutiae.size() - deadMinutiae; }
+    size_t accompliceCount() const { return accomplices.size() - deadAccomplices; }
+
+    size_t slotOf(int id) const {
+        if (idTable.empty()) return npos;
+        size_t mask = idTable.size() - 1;
+        for (size_t i = hashId(id) & mask;; i = (i + 1) & mask) {
+            uint32_t entry = idTable[i];
+            if (entry == 0) return npos;
+            if (slots[entry - 1].id == id) return entry - 1;
         }
     }
 
-    cout << "\n" << COLOR_YELLOW << "Network Summary:\n";
-    cout << "- Total criminals in network: " << visited.size() << "\n";
-    cout << "- Maximum degree of separation: " << max_element(degrees.begin(), degrees.end(),
-        [](const pair<int, int>& a, const pair<int, int>& b) { return a.second < b.second; })->second << "\n";
-    cout << COLOR_RESET;
-}
+    bool contains(int id) const { return slotOf(id) != npos; }
 
-void viewAccomplicesAdjacencyList() {
-    int id;
-    cout << "Enter criminal ID: ";
-    cin >> id;
+    CriminalView view(size_t slot) const {
+        const Slot& s = slots[slot];
+        const NameEntry& n = nameEntries[s.name];
+        return CriminalView{s.id, string_view(names.data() + n.offset, n.length),
+                            MinutiaeSpan(minutiae.data() + s.minutiaeOffset, s.minutiaeCount),
+                            IdSpan(accomplices.data() + s.accompliceOffset, s.accompliceCount)};
+    }
 
-    if (criminalDB.find(id) == criminalDB.end()) {
-        printError("Invalid criminal ID.");
-        return;
+    bool find(int id, CriminalView& record) const {
+        size_t slot = slotOf(id);
+        if (slot == npos) return false;
+        record = view(slot);
+        return true;
     }
 
-    printHeader("ADJACENCY LIST FOR CRIMINAL #" + to_string(id) + " (" + criminalDB[id].name + ")");
-    
-    if (accompliceGraph.find(id) != accompliceGraph.end()) {
-        for (int accompliceId : accompliceGraph[id]) {
-            cout << "[" << id << "] -> [" << accompliceId << "]";
-            if (criminalDB.find(accompliceId) != criminalDB.end()) {
-                cout << " (" << criminalDB[accompliceId].name << ")";
-            }
-            cout << endl;
+    // Inserts or replaces a record. The data must not point into this store.
+    void put(int id, string_view name, MinutiaeSpan fp, IdSpan ac) {
+        Slot s = store(id, name, fp, ac);
+        if (slots.empty() || id > slots.back().id) {
+            slots.push_back(s);
+            if (slots.size() * 2 > idTable.size()) rebuildIds();
+            else placeId(slots.size() - 1);
+            return;
         }
-    } else {
-        printWarning("No connections found for this criminal.");
+        size_t existing = slotOf(id);
+        if (existing != npos) {
+            replace(existing, s);
+            compactIfSparse();
+            return;
+        }
+        auto at = lower_bound(slots.begin(), slots.end(), id,
+                              [](const Slot& slot, int key) { return slot.id < key; });
+        size_t pos = at - slots.begin();
+        slots.insert(at, s);
+        if (slots.size() * 2 > idTable.size()) { rebuildIds(); return; }
+        // Slots after the insert moved up by one; shift their entries in place
+        for (uint32_t& entry : idTable) if (entry > pos) entry++;
+        placeId(pos);
     }
-}
 
-// ================== MATCHING ALGORITHMS ==================
-double compareGraphBasedMatching(const vector<Minutiae>& fp1, const vector<Minutiae>& fp2) {
-    int matches = 0;
-    for (auto& m1 : fp1) {
-        for (auto& m2 : fp2) {
-            if (m1.type != m2.type) continue;
-            double dist = hypot(m1.x - m2.x, m1.y - m2.y);
-            double angleDiff = min(abs(m1.angle - m2.angle), 360 - abs(m1.angle - m2.angle));
-            if (dist <= 10 && angleDiff <= 20) matches++;
+    void put(const Criminal& c) { put(c.id, c.name, c.fingerprint, c.accomplices); }
+
+    // Inserts or replaces a batch of records. New IDs are merged into the slot
+    // table in one pass, so a batch costs O(size) however its IDs interleave
+    // with the stored ones; a repeated ID keeps its last record.
+    void put(const vector<const Criminal*>& batch) {
+        vector<Slot> added;
+        for (const Criminal* c : batch) {
+            Slot s = store(c->id, c->name, c->fingerprint, c->accomplices);
+            size_t existing = slotOf(c->id);
+            if (existing != npos) replace(existing, s);
+            else added.push_back(s);
         }
+        // Compaction moves the arenas under the unfiled slots in `added`, so
+        // it waits until the whole batch is in the slot table
+        if (added.empty()) {
+            compactIfSparse();
+            return;
+        }
+        stable_sort(added.begin(), added.end(), [](const Slot& a, const Slot& b) { return a.id < b.id; });
+        size_t kept = 0;
+        for (size_t i = 0; i < added.size(); ++i) {
+            if (kept > 0 && added[kept - 1].id == added[i].id) {
+                deadMinutiae += added[kept - 1].minutiaeCount;
+                deadAccomplices += added[kept - 1].accompliceCount;
+                added[kept - 1] = added[i];
+            } else {
+                added[kept++] = added[i];
+            }
+        }
+        added.resize(kept);
+
+        bool appending = slots.empty() || added.front().id > slots.back().id;
+        size_t old = slots.size();
+        slots.insert(slots.end(), added.begin(), added.end());
+        if (!appending) {
+            inplace_merge(slots.begin(), slots.begin() + old, slots.end(),
+                          [](const Slot& a, const Slot& b) { return a.id < b.id; });
+            rebuildIds();
+        } else if (slots.size() * 2 > idTable.size()) {
+            rebuildIds();
+        } else {
+            for (size_t slot = old; slot < slots.size(); ++slot) placeId(slot);
+        }
+        compactIfSparse();
     }
-    return 1.0 - (double)matches / max(fp1.size(), fp2.size());
-}
 
-vector<Zone> createZones(const vector<Minutiae>& fingerprint) {
+    void reserve(size_t records, size_t minutiaeTotal, size_t accompliceTotal, size_t nameBytes) {
+        slots.reserve(records);
+        minutiae.reserve(minutiaeTotal);
+        accomplices.reserve(accompliceTotal);
+        names.reserve(nameBytes);
+    }
+
+    void clear() {
+        *this = RecordStore();
+    }
+
+    // Memory held by the store, for the statistics report
+    size_t bytes() const {
+        return slots.capacity() * sizeof(Slot) + minutiae.capacity() * sizeof(Minutiae) +
+               accomplices.capacity() * sizeof(int) + names.capacity() +
+               nameEntries.capacity() * sizeof(NameEntry) +
+               (idTable.capacity() + nameTable.capacity()) * sizeof(uint32_t);
+    }
+
+private:
+    struct Slot {
+        int32_t id;
+        uint32_t name;               // index into nameEntries
+        uint32_t minutiaeCount;
+        uint32_t accompliceCount;
+        uint64_t minutiaeOffset;
+        uint64_t accompliceOffset;
+    };
+
+    struct NameEntry {
+        uint64_t offset;
+        uint32_t length;
+    };
+
+    static size_t hashId(int id) {
+        return (size_t)(((uint64_t)(uint32_t)id * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+
+    static size_t hashName(string_view name) {
+        uint64_t h = 1469598103934665603ull;   // FNV-1a
+        for (unsigned char ch : name) h = (h ^ ch) * 1099511628211ull;
+        return (size_t)(h ^ (h >> 32));
+    }
+
+    // Tables are powers of two kept at most half full; entries are index + 1
+    static size_t tableSize(size_t entries) {
+        size_t size = 16;
+        while (size < entries * 2 + 2) size *= 2;
+        return size;
+    }
+
+    // Appends a record's data to the arenas; the caller files the slot
+    Slot store(int id, string_view name, MinutiaeSpan fp, IdSpan ac) {
+        Slot s;
+        s.id = id;
+        s.name = intern(name);
+        s.minutiaeCount = fp.size();
+        s.accompliceCount = ac.size();
+        s.minutiaeOffset = minutiae.size();
+        s.accompliceOffset = accomplices.size();
+        minutiae.insert(minutiae.end(), fp.begin(), fp.end());
+        accomplices.insert(accomplices.end(), ac.begin(), ac.end());
+        return s;
+    }
+
+    void replace(size_t existing, const Slot& s) {
+        deadMinutiae += slots[existing].minutiaeCount;
+        deadAccomplices += slots[existing].accompliceCount;
+        slots[existing] = s;
+    }
+
+    void compactIfSparse() {
+        if (deadMinutiae * 2 > minutiae.size() || deadAccomplices * 2 > accomplices.size()) compactArenas();
+    }
+
+    void placeId(size_t slot) {
+        size_t mask = idTable.size() - 1;
+        size_t i = hashId(slots[slot].id) & mask;
+        while (idTable[i] != 0) i = (i + 1) & mask;
+        idTable[i] = slot + 1;
+    }
+
+    void rebuildIds() {
+        idTable.assign(tableSize(slots.size()), 0);
+        for (size_t slot = 0; slot < slots.size(); ++slot) placeId(slot);
+    }
+
+    uint32_t intern(string_view name) {
+        if ((nameEntries.size() + 1) * 2 > nameTable.size()) {
+            nameTable.assign(tableSize(nameEntries.size() + 1), 0);
+            size_t mask = nameTable.size() - 1;
+            for (size_t e = 0; e < nameEntries.size(); ++e) {
+                size_t i = hashName(string_view(names.data() + nameEntries[e].offset, nameEntries[e].length)) & mask;
+                while (nameTable[i] != 0) i = (i + 1) & mask;
+                nameTable[i] = e + 1;
+            }
+        }
+        size_t mask = nameTable.size() - 1;
+        size_t i = hashName(name) & mask;
+        for (; nameTable[i] != 0; i = (i + 1) & mask) {
+            const NameEntry& e = nameEntries[nameTable[i] - 1];
+            if (name == string_view(names.data() + e.offset, e.length)) return nameTable[i] - 1;
+        }
+        nameEntries.push_back(NameEntry{names.size(), (uint32_t)name.size()});
+        names.append(name.data(), name.size());
+        nameTable[i] = nameEntries.size();
+        return nameEntries.size() - 1;
+    }
+
+    void compactArenas() {
+        vector<Minutiae> liveMinutiae;
+        vector<int> liveAccomplices;
+        liveMinutiae.reserve(minutiae.size() - deadMinutiae);
+        liveAccomplices.reserve(accomplices.size() - deadAccomplices);
+        for (Slot& s : slots) {
+            liveMinutiae.insert(liveMinutiae.end(), minutiae.begin() + s.minutiaeOffset,
+                                minutiae.begin() + s.minutiaeOffset + s.minutiaeCount);
+            liveAccomplices.insert(liveAccomplices.end(), accomplices.begin() + s.accompliceOffset,
+                                   accomplices.begin() + s.accompliceOffset + s.accompliceCount);
+            s.minutiaeOffset = liveMinutiae.size() - s.minutiaeCount;
+            s.accompliceOffset = liveAccomplices.size() - s.accompliceCount;
+        }
+        minutiae.swap(liveMinutiae);
+        accomplices.swap(liveAccomplices);
+        deadMinutiae = deadAccomplices = 0;
+    }
+
+    vector<Slot> slots;                  // ascending ID
+    vector<Minutiae> minutiae;
+    vector<int> accomplices;
+    string names;
+    vector<NameEntry> nameEntries;
+    vector<uint32_t> idTable, nameTable;
+    size_t deadMinutiae = 0, deadAccomplices = 0;
+};
+
+// ================== BINARY GALLERY ==================
+// On-disk layout (little-endian, every section 8-byte aligned):
+//   GalleryHeader | GalleryRecord[recordCount] (sorted by id) |
+//   Minutiae[minutiaeCount] | int32 accomplices[] | name string pool
+// Minutiae are stored with the in-memory struct layout so a mapped file can be
+// matched in place without parsing.
+const char GALLERY_MAGIC[8] = {'F', 'P', 'G', 'A', 'L', 'L', 'R', 'Y'};
+const uint32_t GALLERY_VERSION = 1;
+const uint32_t GALLERY_BYTE_ORDER = 0x01020304;
+
+struct GalleryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint64_t recordCount;
+    uint64_t minutiaeCount;
+    uint64_t accompliceCount;
+    uint64_t namePoolSize;
+    uint64_t recordsOffset;
+    uint64_t minutiaeOffset;
+    uint64_t accomplicesOffset;
+    uint64_t namesOffset;
+    uint64_t fileSize;
+};
+
+struct GalleryRecord {
+    int32_t id;
+    uint32_t nameLength;
+    uint64_t nameOffset;
+    uint64_t minutiaeOffset;
+    uint64_t accompliceOffset;
+    uint32_t minutiaeCount;
+    uint32_t accompliceCount;
+};
+
+static_assert(sizeof(int) == 4, "gallery format assumes 32-bit int");
+static_assert(sizeof(Minutiae) == 24 && offsetof(Minutiae, type) == 12 &&
+              offsetof(Minutiae, orientation) == 16, "unexpected Minutiae layout");
+static_assert(sizeof(GalleryRecord) == 40, "unexpected GalleryRecord layout");
+
+// Read-only view of a whole file: mmap where available, a heap copy otherwise
+class MappedFile {
+public:
+    MappedFile() {}
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const string& path) {
+        close();
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        bytes = static_cast<const char*>(p);
+        length = st.st_size;
+#else
+        ifstream fin(path, ios::binary);
+        if (!fin) return false;
+        buffer.assign(istreambuf_iterator<char>(fin), istreambuf_iterator<char>());
+        if (buffer.empty()) return false;
+        bytes = buffer.data();
+        length = buffer.size();
+#endif
+        return true;
+    }
+
+    void close() {
+#ifndef _WIN32
+        if (bytes) munmap(const_cast<char*>(bytes), length);
+#else
+        buffer.clear();
+#endif
+        bytes = nullptr;
+        length = 0;
+    }
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+    bool isOpen() const { return bytes != nullptr; }
+
+private:
+    const char* bytes = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    vector<char> buffer;
+#endif
+};
+
+class MappedGallery {
+public:
+    bool open(const string& path, string& error) {
+        close();
+        if (!file.open(path)) {
+            error = "cannot map " + path;
+            return false;
+        }
+        if (!validate(error)) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        file.close();
+        header = nullptr;
+        records = nullptr;
+        minutiae = nullptr;
+        accomplices = nullptr;
+        names = nullptr;
+    }
+
+    bool isOpen() const { return header != nullptr; }
+    size_t size() const { return header ? header->recordCount : 0; }
+    const GalleryRecord& record(size_t i) const { return records[i]; }
+
+    // Binary search over the id-sorted record table
+    const GalleryRecord* find(int id) const {
+        const GalleryRecord* first = records;
+        const GalleryRecord* last = records + size();
+        const GalleryRecord* it = lower_bound(first, last, id,
+            [](const GalleryRecord& r, int key) { return r.id < key; });
+        return (it != last && it->id == id) ? it : nullptr;
+    }
+
+    size_t minutiaeCount() const { return header ? header->minutiaeCount : 0; }
+    size_t accompliceCount() const { return header ? header->accompliceCount : 0; }
+    size_t namePoolSize() const { return header ? header->namePoolSize : 0; }
+
+    string_view name(const GalleryRecord& r) const {
+        return string_view(names + r.nameOffset, r.nameLength);
+    }
+
+    MinutiaeSpan fingerprint(const GalleryRecord& r) const {
+        return MinutiaeSpan(minutiae + r.minutiaeOffset, r.minutiaeCount);
+    }
+
+    const int32_t* accompliceList(const GalleryRecord& r) const {
+        return accomplices + r.accompliceOffset;
+    }
+
+private:
+    bool validate(string& error) {
+        if (file.size() < sizeof(GalleryHeader)) {
+            error = "gallery file is truncated";
+            return false;
+        }
+        const GalleryHeader* h = reinterpret_cast<const GalleryHeader*>(file.data());
+        if (memcmp(h->magic, GALLERY_MAGIC, sizeof(GALLERY_MAGIC)) != 0) {
+            error = "not a gallery file";
+            return false;
+        }
+        if (h->version != GALLERY_VERSION || h->byteOrder != GALLERY_BYTE_ORDER) {
+            error = "unsupported gallery version " + to_string(h->version);
+            return false;
+        }
+        if (h->fileSize != file.size() ||
+            !sectionFits(h->recordsOffset, h->recordCount, sizeof(GalleryRecord)) ||
+            !sectionFits(h->minutiaeOffset, h->minutiaeCount, sizeof(Minutiae)) ||
+            !sectionFits(h->accomplicesOffset, h->accompliceCount, sizeof(int32_t)) ||
+            !sectionFits(h->namesOffset, h->namePoolSize, 1)) {
+            error = "gallery sections out of bounds";
+            return false;
+        }
+
+        header = h;
+        records = reinterpret_cast<const GalleryRecord*>(file.data() + h->recordsOffset);
+        minutiae = reinterpret_cast<const Minutiae*>(file.data() + h->minutiaeOffset);
+        accomplices = reinterpret_cast<const int32_t*>(file.data() + h->accomplicesOffset);
+        names = file.data() + h->namesOffset;
+
+        for (size_t i = 0; i < h->recordCount; ++i) {
+            const GalleryRecord& r = records[i];
+            if ((i > 0 && records[i - 1].id >= r.id) ||
+                r.nameOffset + r.nameLength > h->namePoolSize ||
+                r.minutiaeOffset + r.minutiaeCount > h->minutiaeCount ||
+                r.accompliceOffset + r.accompliceCount > h->accompliceCount) {
+                error = "corrupt gallery record #" + to_string(i);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool sectionFits(uint64_t offset, uint64_t count, size_t elementSize) const {
+        if (offset % 8 != 0 || offset > file.size()) return false;
+        return count <= (file.size() - offset) / elementSize;
+    }
+
+    MappedFile file;
+    const GalleryHeader* header = nullptr;
+    const GalleryRecord* records = nullptr;
+    const Minutiae* minutiae = nullptr;
+    const int32_t* accomplices = nullptr;
+    const char* names = nullptr;
+};
+
+MappedGallery gallery;
+
+static uint64_t alignTo8(uint64_t n) {
+    return (n + 7) & ~uint64_t(7);
+}
+
+// Writes to a temporary file and renames it over the target so readers never
+// observe a half-written gallery.
+bool writeGalleryFile(const string& path, const RecordStore& db) {
+    GalleryHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, GALLERY_MAGIC, sizeof(GALLERY_MAGIC));
+    h.version = GALLERY_VERSION;
+    h.byteOrder = GALLERY_BYTE_ORDER;
+    h.recordCount = db.size();
+
+    vector<GalleryRecord> records;
+    records.reserve(db.size());
+    for (CriminalView crim : db) {
+        GalleryRecord r;
+        memset(&r, 0, sizeof(r));
+        r.id = crim.id;
+        r.nameLength = crim.name.size();
+        r.nameOffset = h.namePoolSize;
+        r.minutiaeOffset = h.minutiaeCount;
+        r.minutiaeCount = crim.fingerprint.size();
+        r.accompliceOffset = h.accompliceCount;
+        r.accompliceCount = crim.accomplices.size();
+        records.push_back(r);
+        h.namePoolSize += crim.name.size();
+        h.minutiaeCount += crim.fingerprint.size();
+        h.accompliceCount += crim.accomplices.size();
+    }
+
+    h.recordsOffset = alignTo8(sizeof(GalleryHeader));
+    h.minutiaeOffset = alignTo8(h.recordsOffset + h.recordCount * sizeof(GalleryRecord));
+    h.accomplicesOffset = alignTo8(h.minutiaeOffset + h.minutiaeCount * sizeof(Minutiae));
+    h.namesOffset = alignTo8(h.accomplicesOffset + h.accompliceCount * sizeof(int32_t));
+    h.fileSize = h.namesOffset + h.namePoolSize;
+
+    string tmpPath = path + ".tmp";
+    ofstream fout(tmpPath, ios::binary | ios::trunc);
+    if (!fout) return false;
+
+    auto padTo = [&](uint64_t offset) {
+        static const char zeros[8] = {0};
+        uint64_t pos = fout.tellp();
+        if (offset > pos) fout.write(zeros, offset - pos);
+    };
+
+    fout.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    padTo(h.recordsOffset);
+    fout.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(GalleryRecord));
+    padTo(h.minutiaeOffset);
+    for (CriminalView crim : db) {
+        for (const auto& m : crim.fingerprint) {
+            Minutiae packed;
+            memset(&packed, 0, sizeof(packed)); // keep padding bytes deterministic
+            packed.x = m.x;
+            packed.y = m.y;
+            packed.angle = m.angle;
+            packed.type = m.type;
+            packed.orientation = m.orientation;
+            fout.write(reinterpret_cast<const char*>(&packed), sizeof(packed));
+        }
+    }
+    padTo(h.accomplicesOffset);
+    for (CriminalView crim : db) {
+        for (int ac : crim.accomplices) {
+            int32_t v = ac;
+            fout.write(reinterpret_cast<const char*>(&v), sizeof(v));
+        }
+    }
+    padTo(h.namesOffset);
+    for (CriminalView crim : db) fout.write(crim.name.data(), crim.name.size());
+
+    fout.close();
+    if (!fout) {
+        remove(tmpPath.c_str());
+        return false;
+    }
+#ifdef _WIN32
+    remove(path.c_str()); // rename() does not replace existing files on Windows
+#endif
+    return rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+// Materializes a mapped gallery into the record store with bulk copies only
+void loadFromGallery(const MappedGallery& g, RecordStore& db) {
+    db.clear();
+    db.reserve(g.size(), g.minutiaeCount(), g.accompliceCount(), g.namePoolSize());
+    for (size_t i = 0; i < g.size(); ++i) {
+        const GalleryRecord& r = g.record(i);
+        db.put(r.id, g.name(r), g.fingerprint(r), IdSpan(g.accompliceList(r), r.accompliceCount));
+    }
+}
+
+// ================== JOURNAL ==================
+// Enrollments are appended to a journal instead of rewriting the database.
+// Each frame is: magic | op | payload length | payload | crc32(op..payload).
+// ADD and UPDATE both carry the full record, so replay is an idempotent upsert
+// and a crash between compaction steps can never lose or duplicate a record.
+const uint32_t JOURNAL_MAGIC = 0x4C4E524A; // "JRNL"
+const uint64_t JOURNAL_COMPACT_BYTES = 4 << 20;
+bool autoCompact = true;   // compact in the background past JOURNAL_COMPACT_BYTES
+
+enum JournalOp : uint8_t {
+    JOURNAL_ADD = 1,
+    JOURNAL_UPDATE = 2
+};
+
+FILE* journalOut = nullptr;
+mutex journalMutex;
+uint64_t journalBytes = 0;           // size of the intact journal on disk; guarded by journalMutex
+
+// journalBytes for threads that do not hold journalMutex; compaction
+// rewrites it from its own thread
+uint64_t journalSize() {
+    lock_guard<mutex> lock(journalMutex);
+    return journalBytes;
+}
+
+uint32_t crc32(const char* data, size_t n, uint32_t crc = 0) {
+    // Built once; a function-local static is initialized thread-safely
+    static const array<uint32_t, 256> table = [] {
+        array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < n; ++i)
+        crc = table[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+template <typename T>
+void putValue(string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+struct ByteReader {
+    const char* pos;
+    const char* end;
+
+    template <typename T>
+    bool get(T& value) {
+        if ((size_t)(end - pos) < sizeof(T)) return false;
+        memcpy(&value, pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+
+    bool getString(string& s, size_t n) {
+        if ((size_t)(end - pos) < n) return false;
+        s.assign(pos, n);
+        pos += n;
+        return true;
+    }
+};
+
+string serializeCriminal(const Criminal& c) {
+    string out;
+    putValue<int32_t>(out, c.id);
+    putValue<uint32_t>(out, c.name.size());
+    out += c.name;
+    putValue<uint32_t>(out, c.fingerprint.size());
+    for (const auto& m : c.fingerprint) {
+        putValue<int32_t>(out, m.x);
+        putValue<int32_t>(out, m.y);
+        putValue<int32_t>(out, m.angle);
+        putValue<char>(out, m.type);
+        putValue<double>(out, m.orientation);
+    }
+    putValue<uint32_t>(out, c.accomplices.size());
+    for (int ac : c.accomplices) putValue<int32_t>(out, ac);
+    return out;
+}
+
+bool deserializeCriminal(const char* data, size_t n, Criminal& c) {
+    ByteReader in{data, data + n};
+    int32_t id;
+    uint32_t count;
+    if (!in.get(id) || !in.get(count) || !in.getString(c.name, count)) return false;
+    c.id = id;
+    if (!in.get(count)) return false;
+    c.fingerprint.resize(count);
+    for (auto& m : c.fingerprint) {
+        int32_t x, y, angle;
+        if (!in.get(x) || !in.get(y) || !in.get(angle) || !in.get(m.type) || !in.get(m.orientation))
+            return false;
+        m.x = x;
+        m.y = y;
+        m.angle = angle;
+    }
+    if (!in.get(count)) return false;
+    c.accomplices.resize(count);
+    for (auto& ac : c.accomplices) {
+        int32_t v;
+        if (!in.get(v)) return false;
+        ac = v;
+    }
+    return in.pos == in.end;
+}
+
+string encodeJournalFrame(JournalOp op, const Criminal& c) {
+    string payload = serializeCriminal(c);
+    string frame;
+    putValue<uint32_t>(frame, JOURNAL_MAGIC);
+    putValue<uint8_t>(frame, op);
+    putValue<uint32_t>(frame, payload.size());
+    frame += payload;
+    putValue<uint32_t>(frame, crc32(frame.data() + 4, frame.size() - 4));
+    return frame;
+}
+
+// Caller must hold journalMutex
+bool writeJournalBytes(const string& bytes) {
+    if (!journalOut) journalOut = fopen(journalFile.c_str(), "ab");
+    if (!journalOut) return false;
+    if (fwrite(bytes.data(), 1, bytes.size(), journalOut) != bytes.size()) return false;
+    if (fflush(journalOut) != 0) return false;
+#ifndef _WIN32
+    fsync(fileno(journalOut));
+#endif
+    return true;
+}
+
+void closeJournal() {
+    lock_guard<mutex> lock(journalMutex);
+    if (journalOut) fclose(journalOut);
+    journalOut = nullptr;
+}
+
+// Durably records a batch of enrollments with one write and one fsync; cost
+// is independent of the gallery size
+bool appendJournal(JournalOp op, const vector<const Criminal*>& records) {
+    string frames;
+    for (const Criminal* c : records) frames += encodeJournalFrame(op, *c);
+    lock_guard<mutex> lock(journalMutex);
+    if (!writeJournalBytes(frames)) return false;
+    journalBytes += frames.size();
+    return true;
+}
+
+// Applies every intact frame on top of db. A torn or corrupt tail (e.g. from a
+// crash mid-append) is reported and cut off so later appends stay readable.
+void replayJournal(RecordStore& db) {
+    ifstream fin(journalFile, ios::binary);
+    if (!fin) return;
+    string bytes((istreambuf_iterator<char>(fin)), istreambuf_iterator<char>());
+    fin.close();
+
+    size_t pos = 0, applied = 0;
+    const size_t headerSize = 4 + 1 + 4;
+    while (bytes.size() - pos >= headerSize + 4) {
+        ByteReader in{bytes.data() + pos, bytes.data() + bytes.size()};
+        uint32_t magic = 0, length = 0;
+        uint8_t op = 0;
+        in.get(magic);
+        in.get(op);
+        in.get(length);
+        if (magic != JOURNAL_MAGIC || bytes.size() - pos - headerSize - 4 < length) break;
+
+        const char* payload = bytes.data() + pos + headerSize;
+        uint32_t stored;
+        memcpy(&stored, payload + length, 4);
+        if (stored != crc32(bytes.data() + pos + 4, headerSize - 4 + length)) break;
+
+        Criminal c;
+        if ((op != JOURNAL_ADD && op != JOURNAL_UPDATE) || !deserializeCriminal(payload, length, c))
+            break;
+        db.put(c);
+        applied++;
+        pos += headerSize + length + 4;
+    }
+    journalBytes = pos;
+
+    if (pos < bytes.size()) {
+        printWarning("Discarding " + to_string(bytes.size() - pos) +
+                     " bytes of damaged journal after " + to_string(applied) + " records");
+        string tmpPath = journalFile + ".tmp";
+        ofstream fout(tmpPath, ios::binary | ios::trunc);
+        fout.write(bytes.data(), pos);
+        fout.close();
+#ifdef _WIN32
+        remove(journalFile.c_str());
+#endif
+        rename(tmpPath.c_str(), journalFile.c_str());
+    }
+}
+
+// ================== GALLERY COLUMNS ==================
+// Structure-of-arrays copy of every gallery template, so the matching kernels
+// can stream x/y/angle/type for many minutiae at once. Template i occupies
+// [offsets[i], offsets[i + 1]) of each column.
+//
+// Within a template, minutiae are ordered by GRID_CELL x GRID_CELL cell
+// (row-major), and a sorted cell table records where each occupied cell starts.
+// The cell size equals the 10 px pairing radius, so every possible partner of a
+// probe point lies in the 3x3 block of cells around it, and each row of that
+// block is one contiguous slice of the columns.
+//
+// The columns are packed to 6 bytes per minutia (a Minutiae takes 24): x and y
+// are stored relative to the template's bounding-box corner in 16 bits, and
+// the angle (9 bits) shares a 16-bit word with the type (top bit set for a
+// bifurcation). Cells are laid out in that same relative frame, so a cell key
+// fits in 32 bits and a cell start in 16. A template that cannot be packed
+// exactly - an angle outside 0..511, a type other than R or B, wider than
+// PACKED_SPAN or more than 65535 points - keeps a plain copy in `wide`, which
+// the matchers use instead.
+const int GRID_CELL = 10;
+const size_t GRID_MIN_POINTS = 16; // smaller templates are scanned directly
+const int PACKED_SPAN = 32751;     // leaves room for the probe clamp in packedProbe()
+const uint16_t PACKED_ANGLE_MASK = 0x1ff;
+const uint16_t PACKED_BIFURCATION = 0x8000;
+
+int gridCoord(int v) {
+    return v >= 0 ? v / GRID_CELL : -((GRID_CELL - 1 - v) / GRID_CELL);
+}
+
+// Row-major key of a cell in the packed frame; cells from -4 (a clamped probe
+// point's neighbours) up to PACKED_SPAN / GRID_CELL fit in 16 bits per axis
+uint32_t cellKey(int cx, int cy) {
+    return (uint32_t)(cy + 4) << 16 | (uint32_t)(cx + 4);
+}
+
+bool packable(MinutiaeSpan fp, int minX, int minY, int maxX, int maxY) {
+    if (fp.size() > 65535) return false;
+    if ((int64_t)maxX - minX > PACKED_SPAN || (int64_t)maxY - minY > PACKED_SPAN) return false;
+    for (const auto& m : fp)
+        if (m.angle < 0 || m.angle > PACKED_ANGLE_MASK || (m.type != 'R' && m.type != 'B')) return false;
+    return true;
+}
+
+vector<Zone> createZones(MinutiaeSpan fingerprint);
+
+struct GalleryColumns {
+    vector<int> ids;
+    vector<size_t> offsets = vector<size_t>(1, 0);
+    vector<int32_t> originX, originY;                  // per template, subtracted before packing
+    vector<int16_t> xs, ys;
+    vector<uint16_t> angleTypes;
+    unordered_map<size_t, vector<Minutiae>> wide;      // templates the packed columns cannot hold
+    vector<size_t> cellOffsets = vector<size_t>(1, 0); // template i: [cellOffsets[i], cellOffsets[i + 1])
+    vector<uint32_t> cellKeys;                         // ascending within a template
+    vector<uint16_t> cellStarts;                       // first minutia of the cell, template-relative
+    vector<size_t> zoneOffsets = vector<size_t>(1, 0); // template i: [zoneOffsets[i], zoneOffsets[i + 1])
+    vector<PackedZone> zones;                          // createZones() output, computed once per template
+
+    size_t size() const { return ids.size(); }
+    size_t first(size_t i) const { return offsets[i]; }
+    size_t length(size_t i) const { return offsets[i + 1] - offsets[i]; }
+    const PackedZone* zonesOf(size_t i) const { return zones.data() + zoneOffsets[i]; }
+    size_t zoneCount(size_t i) const { return zoneOffsets[i + 1] - zoneOffsets[i]; }
+
+    // Memory held by the template store, for the statistics report
+    size_t bytes() const {
+        size_t total = ids.capacity() * sizeof(int) + offsets.capacity() * sizeof(size_t) +
+                       (originX.capacity() + originY.capacity()) * sizeof(int32_t) +
+                       (xs.capacity() + ys.capacity() + angleTypes.capacity()) * sizeof(int16_t) +
+                       cellOffsets.capacity() * sizeof(size_t) + cellKeys.capacity() * sizeof(uint32_t) +
+                       cellStarts.capacity() * sizeof(uint16_t) + zoneOffsets.capacity() * sizeof(size_t) +
+                       zones.capacity() * sizeof(PackedZone);
+        for (const auto& entry : wide) total += entry.second.capacity() * sizeof(Minutiae);
+        return total;
+    }
+
+    void clear() {
+        ids.clear();
+        offsets.assign(1, 0);
+        originX.clear();
+        originY.clear();
+        xs.clear();
+        ys.clear();
+        angleTypes.clear();
+        wide.clear();
+        cellOffsets.assign(1, 0);
+        cellKeys.clear();
+        cellStarts.clear();
+        zoneOffsets.assign(1, 0);
+        zones.clear();
+    }
+
+    void append(int id, MinutiaeSpan fp) {
+        int minX = INT_MAX, minY = INT_MAX, maxX = INT_MIN, maxY = INT_MIN;
+        for (const auto& m : fp) {
+            minX = min(minX, m.x);
+            minY = min(minY, m.y);
+            maxX = max(maxX, m.x);
+            maxY = max(maxY, m.y);
+        }
+        bool packed = fp.empty() || packable(fp, minX, minY, maxX, maxY);
+        if (!packed) wide[ids.size()].assign(fp.begin(), fp.end());
+
+        vector<pair<uint32_t, uint32_t>> order(fp.size());
+        for (size_t i = 0; i < fp.size(); ++i)
+            order[i] = make_pair(packed ? cellKey(gridCoord(fp[i].x - minX), gridCoord(fp[i].y - minY)) : 0, (uint32_t)i);
+        sort(order.begin(), order.end());
+
+        ids.push_back(id);
+        originX.push_back(fp.empty() ? 0 : minX);
+        originY.push_back(fp.empty() ? 0 : minY);
+        for (size_t k = 0; k < order.size(); ++k) {
+            const Minutiae& m = fp[order[k].second];
+            // Slots of a wide template are never read
+            xs.push_back(packed ? m.x - minX : 0);
+            ys.push_back(packed ? m.y - minY : 0);
+            angleTypes.push_back(packed ? m.angle | (m.type == 'B' ? PACKED_BIFURCATION : 0) : 0);
+            if (packed && (k == 0 || order[k].first != order[k - 1].first)) {
+                cellKeys.push_back(order[k].first);
+                cellStarts.push_back(k);
+            }
+        }
+        offsets.push_back(xs.size());
+        cellOffsets.push_back(cellKeys.size());
+
+        for (const Zone& z : createZones(fp))
+            zones.push_back(PackedZone{z.x_center, z.y_center, (float)z.avgOrientation, z.count});
+        zoneOffsets.push_back(zones.size());
+    }
+};
+
+void buildGalleryColumns(GalleryColumns& g, const RecordStore& db) {
+    g.clear();
+    size_t total = db.minutiaeCount();
+    g.ids.reserve(db.size());
+    g.offsets.reserve(db.size() + 1);
+    g.originX.reserve(db.size());
+    g.originY.reserve(db.size());
+    g.xs.reserve(total);
+    g.ys.reserve(total);
+    g.angleTypes.reserve(total);
+    for (CriminalView c : db) g.append(c.id, c.fingerprint);
+}
+
+// ================== WORKER POOL ==================
+// Fixed pool of search threads. parallelFor() cuts [0, count) into chunks and
+// deals them round-robin onto per-thread deques; each thread drains its own
+// deque from the back and steals from the front of the others when it runs
+// dry, so an uneven gallery slice never leaves cores idle. The calling thread
+// takes part as the last slot.
+class WorkerPool {
+public:
+    typedef function<void(size_t begin, size_t end, unsigned slot)> RangeBody;
+
+    explicit WorkerPool(unsigned threads) {
+        threads = max(1u, threads);
+        for (unsigned i = 0; i < threads; ++i) queues.emplace_back(new RangeQueue());
+        for (unsigned i = 0; i + 1 < threads; ++i) workers.emplace_back(&WorkerPool::workerLoop, this, i);
+    }
+
+    ~WorkerPool() {
+        {
+            lock_guard<mutex> lock(stateLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : workers) t.join();
+    }
+
+    unsigned size() const { return queues.size(); }
+
+    void parallelFor(size_t count, size_t chunk, const RangeBody& body) {
+        if (count == 0) return;
+        lock_guard<mutex> serial(jobLock);
+        chunk = max<size_t>(1, chunk);
+        size_t chunks = (count + chunk - 1) / chunk;
+        job = &body;
+        pending = chunks;
+        for (size_t c = 0; c < chunks; ++c) {
+            RangeQueue& q = *queues[c % queues.size()];
+            lock_guard<mutex> lock(q.lock);
+            q.ranges.push_back(make_pair(c * chunk, min(count, (c + 1) * chunk)));
+        }
+        {
+            lock_guard<mutex> lock(stateLock);
+            generation++;
+        }
+        wake.notify_all();
+
+        unsigned self = queues.size() - 1;
+        while (runOne(self)) {}
+        unique_lock<mutex> lock(stateLock);
+        done.wait(lock, [this] { return pending == 0; });
+        job = nullptr;
+    }
+
+private:
+    struct RangeQueue {
+        mutex lock;
+        deque<pair<size_t, size_t>> ranges;
+    };
+
+    bool takeRange(unsigned slot, pair<size_t, size_t>& range) {
+        {
+            RangeQueue& own = *queues[slot];
+            lock_guard<mutex> lock(own.lock);
+            if (!own.ranges.empty()) {
+                range = own.ranges.back();
+                own.ranges.pop_back();
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues.size(); ++k) {
+            RangeQueue& victim = *queues[(slot + k) % queues.size()];
+            lock_guard<mutex> lock(victim.lock);
+            if (!victim.ranges.empty()) {
+                range = victim.ranges.front();
+                victim.ranges.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool runOne(unsigned slot) {
+        pair<size_t, size_t> range;
+        if (!takeRange(slot, range)) return false;
+        (*job)(range.first, range.second, slot);
+        if (--pending == 0) {
+            lock_guard<mutex> lock(stateLock);
+            done.notify_all();
+        }
+        return true;
+    }
+
+    void workerLoop(unsigned slot) {
+        uint64_t seen = 0;
+        while (true) {
+            {
+                unique_lock<mutex> lock(stateLock);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+            while (runOne(slot)) {}
+        }
+    }
+
+    vector<unique_ptr<RangeQueue>> queues;
+    vector<thread> workers;
+    mutex jobLock;
+    mutex stateLock;
+    condition_variable wake, done;
+    const RangeBody* job = nullptr;
+    atomic<size_t> pending{0};
+    uint64_t generation = 0;
+    bool stopping = false;
+};
+
+unsigned searchThreads = 0; // 0 = one per hardware thread
+
+WorkerPool& searchPool() {
+    static WorkerPool pool(searchThreads ? searchThreads : max(1u, thread::hardware_concurrency()));
+    return pool;
+}
+
+// ================== DATABASE MANAGEMENT ==================
+bool saveTextDatabase(const string& path, const RecordStore& db) {
+    string tmpPath = path + ".tmp";
+    ofstream fout(tmpPath, ios::trunc);
+    for (CriminalView crim : db) {
+        fout << crim.id << "|" << crim.name;
+        for (auto& m : crim.fingerprint)
+            fout << "|" << m.x << "|" << m.y << "|" << m.angle << "|" << m.type << "|" << m.orientation;
+        fout << "|AC";
+        for (int ac : crim.accomplices)
+            fout << "|" << ac;
+        fout << "\n";
+    }
+    fout.close();
+    if (!fout) {
+        remove(tmpPath.c_str());
+        return false;
+    }
+#ifdef _WIN32
+    remove(path.c_str());
+#endif
+    return rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+// ---- Text record parsing ----
+// Same rules stoi/stod gave the original loader (leading whitespace skipped,
+// trailing characters ignored), without exceptions.
+bool parseIntField(const char* first, const char* last, int& value) {
+    while (first < last && isspace((unsigned char)*first)) first++;
+    if (first < last && *first == '+' && first + 1 < last && isdigit((unsigned char)first[1])) first++;
+    return from_chars(first, last, value).ec == errc();
+}
+
+bool parseDoubleField(const char* first, const char* last, double& value) {
+    while (first < last && isspace((unsigned char)*first)) first++;
+    if (first < last && *first == '+' && first + 1 < last && *(first + 1) != '-') first++;
+    return from_chars(first, last, value).ec == errc();
+}
+
+// '|'-separated fields of one line. next() fails once the line is used up
+// and then, like getline(ss, token, '|'), leaves the previous field in place.
+struct FieldCursor {
+    const char* pos;
+    const char* end;
+
+    bool next(const char*& first, const char*& last) {
+        if (pos >= end) return false;
+        first = pos;
+        last = static_cast<const char*>(memchr(pos, '|', end - pos));
+        if (!last) last = end;
+        pos = last < end ? last + 1 : end;
+        return true;
+    }
+};
+
+// Parses the fields after the leading ID:
+//   name|x|y|angle|type|orientation|...|AC|accomplice|...
+// A bad minutia ends the minutiae (the partial point is dropped) and a bad
+// accomplice ends the list, as before; `malformed` records that it happened.
+void parseRecordTail(FieldCursor& f, Criminal& c, bool& malformed) {
+    const char *first = f.end, *last = f.end;
+    f.next(first, last);
+    c.name.assign(first, last);
+
+    while (f.next(first, last)) {
+        if (last - first == 2 && first[0] == 'A' && first[1] == 'C') break;
+        Minutiae m;
+        bool ok = parseIntField(first, last, m.x);
+        ok = ok && (f.next(first, last), parseIntField(first, last, m.y));
+        ok = ok && (f.next(first, last), parseIntField(first, last, m.angle));
+        if (ok) {
+            f.next(first, last);
+            m.type = first < last ? *first : '\0';
+        }
+        ok = ok && (f.next(first, last), parseDoubleField(first, last, m.orientation));
+        if (!ok) {
+            malformed = true;
+            break;
+        }
+        c.fingerprint.push_back(m);
+    }
+
+    while (f.next(first, last)) {
+        int id;
+        if (!parseIntField(first, last, id)) {
+            malformed = true;
+            break;
+        }
+        c.accomplices.push_back(id);
+    }
+}
+
+// Stream front end for single records (batch probes, server requests)
+void parseRecordFields(stringstream& ss, Criminal& c) {
+    string rest(istreambuf_iterator<char>(ss), {});
+    FieldCursor f = {rest.data(), rest.data() + rest.size()};
+    bool malformed = false;
+    parseRecordTail(f, c, malformed);
+}
+
+const size_t TEXT_CHUNK_MIN = 1 << 20;   // bytes per parse task, at least
+const size_t REPORTED_LINES = 5;         // malformed line numbers listed
+
+struct TextChunk {
+    vector<Criminal> records;
+    size_t lines = 0;
+    vector<size_t> malformed;            // line numbers within the chunk
+};
+
+// Maps the file and parses newline-aligned chunks across the worker pool.
+// Records are merged in file order, so a repeated ID keeps its last line.
+void loadTextDatabase(const string& path, RecordStore& db) {
+    db.clear();
+    MappedFile file;
+    if (!file.open(path)) return;
+    const char* data = file.data();
+    size_t size = file.size();
+
+    size_t chunks = max<size_t>(1, min<size_t>(searchPool().size() * 4, size / TEXT_CHUNK_MIN));
+    vector<size_t> bounds(chunks + 1, size);
+    bounds[0] = 0;
+    for (size_t i = 1; i < chunks; ++i) {
+        const char* cut = static_cast<const char*>(memchr(data + i * (size / chunks), '\n', size - i * (size / chunks)));
+        bounds[i] = max(bounds[i - 1], cut ? (size_t)(cut - data) + 1 : size);
+    }
+
+    vector<TextChunk> parsed(chunks);
+    searchPool().parallelFor(chunks, 1, [&](size_t begin, size_t end, unsigned) {
+        for (size_t i = begin; i < end; ++i) {
+            TextChunk& out = parsed[i];
+            const char* p = data + bounds[i];
+            const char* stop = data + bounds[i + 1];
+            while (p < stop) {
+                const char* eol = static_cast<const char*>(memchr(p, '\n', stop - p));
+                if (!eol) eol = stop;
+                const char* lineEnd = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+                size_t line = out.lines++;
+
+                FieldCursor f = {p, lineEnd};
+                const char *first = lineEnd, *last = lineEnd;
+                Criminal c;
+                bool malformed = false;
+                f.next(first, last);
+                if (parseIntField(first, last, c.id)) {
+                    parseRecordTail(f, c, malformed);
+                    out.records.push_back(move(c));
+                } else {
+                    malformed = lineEnd > p;   // blank lines are not worth a warning
+                }
+                if (malformed) out.malformed.push_back(line);
+                p = eol + 1;
+            }
+        }
+    });
+
+    size_t records = 0, minutiae = 0, accomplices = 0, nameBytes = 0;
+    for (const auto& chunk : parsed) {
+        records += chunk.records.size();
+        for (const auto& c : chunk.records) {
+            minutiae += c.fingerprint.size();
+            accomplices += c.accomplices.size();
+            nameBytes += c.name.size();
+        }
+    }
+    db.reserve(records, minutiae, accomplices, nameBytes);
+
+    size_t firstLine = 1, badLines = 0;
+    string listed;
+    for (auto& chunk : parsed) {
+        for (const auto& c : chunk.records) db.put(c);
+        for (size_t line : chunk.malformed) {
+            if (badLines++ < REPORTED_LINES) listed += (listed.empty() ? "" : ", ") + to_string(firstLine + line);
+        }
+        firstLine += chunk.lines;
+        vector<Criminal>().swap(chunk.records);
+    }
+    if (badLines)
+        printWarning(to_string(badLines) + " malformed line(s) in " + path + " (line " + listed +
+                     (badLines > REPORTED_LINES ? ", ..." : "") + ")");
+}
+
+// The binary gallery takes precedence once it exists; the text file is only
+// used until a site has been migrated with --convert-to-binary.
+void loadCriminalDB(RecordStore& db, GalleryColumns& columns) {
+    STAT_TIMER(TIMER_GALLERY_LOAD);
+    string error;
+    ifstream probe(galleryFile, ios::binary);
+    if (probe.good()) {
+        probe.close();
+        if (gallery.open(galleryFile, error)) {
+            loadFromGallery(gallery, db);
+            replayJournal(db);
+            buildGalleryColumns(columns, db);
+            return;
+        }
+        printWarning("Ignoring binary gallery (" + error + "), falling back to text database");
+    }
+    loadTextDatabase(databaseFile, db);
+    replayJournal(db);
+    buildGalleryColumns(columns, db);
+}
+
+// ---- Compaction: fold the journal into a fresh snapshot ----
+// Started and adopted by whichever thread enrolls (the interactive loop, the
+// server's enroll writer, the bench writer); compactionLock serializes them.
+mutex compactionLock;
+thread compactionThread;
+atomic<bool> compactionDone(false);
+bool compactionRunning = false;      // guarded by compactionLock
+bool compactionSucceeded = false;    // written by the compaction thread before compactionDone
+
+bool writeSnapshot(const RecordStore& db, bool binary) {
+    return binary ? writeGalleryFile(galleryFile, db) : saveTextDatabase(databaseFile, db);
+}
+
+// Drops the first cutBytes of the journal (now part of the snapshot) while
+// keeping any frames appended after the snapshot was taken.
+bool truncateJournalPrefix(uint64_t cutBytes) {
+    lock_guard<mutex> lock(journalMutex);
+    if (journalOut) fclose(journalOut);
+    journalOut = nullptr;
+
+    ifstream fin(journalFile, ios::binary);
+    string bytes((istreambuf_iterator<char>(fin)), istreambuf_iterator<char>());
+    fin.close();
+    if (cutBytes > bytes.size()) return false;
+
+    string tmpPath = journalFile + ".tmp";
+    ofstream fout(tmpPath, ios::binary | ios::trunc);
+    fout.write(bytes.data() + cutBytes, bytes.size() - cutBytes);
+    fout.close();
+    if (!fout) return false;
+#ifdef _WIN32
+    remove(journalFile.c_str());
+#endif
+    if (rename(tmpPath.c_str(), journalFile.c_str()) != 0) return false;
+    journalBytes = bytes.size() - cutBytes;
+    return true;
+}
+
+void adoptSnapshot(bool binary) {
+    string error;
+    if (binary && !gallery.open(galleryFile, error))
+        printError("Failed to reopen gallery: " + error);
+}
+
+// Adopts the result of a finished background compaction; caller holds compactionLock
+void adoptCompaction(bool wait) {
+    if (!compactionRunning || (!wait && !compactionDone)) return;
+    compactionThread.join();
+    compactionRunning = false;
+    compactionDone = false;
+    if (compactionSucceeded) adoptSnapshot(gallery.isOpen());
+    else printWarning("Journal compaction failed; records remain in the journal");
+}
+
+void pollCompaction(bool wait) {
+    lock_guard<mutex> lock(compactionLock);
+    adoptCompaction(wait);
+}
+
+// `db` is a published gallery version's records; the background writer keeps
+// that version alive until the snapshot is on disk
+void startCompaction(shared_ptr<const RecordStore> db, bool background) {
+    lock_guard<mutex> lock(compactionLock);
+    adoptCompaction(true);
+    uint64_t cutBytes = journalSize();
+    bool binary = gallery.isOpen();
+
+    if (!background) {
+        compactionSucceeded = writeSnapshot(*db, binary) && truncateJournalPrefix(cutBytes);
+        if (compactionSucceeded) adoptSnapshot(binary);
+        else printError("Failed to write database snapshot");
+        return;
+    }
+
+    compactionRunning = true;
+    compactionThread = thread([db, binary, cutBytes]() {
+        compactionSucceeded = writeSnapshot(*db, binary) && truncateJournalPrefix(cutBytes);
+        compactionDone = true;
+    });
+}
+
+// Rewrites the full snapshot synchronously and empties the journal
+void saveCriminalDB(shared_ptr<const RecordStore> db) {
+    startCompaction(db, false);
+}
+
+// Offline migration between the text database and the binary gallery
+int convertDatabase(const string& direction, const string& inPath, const string& outPath) {
+    RecordStore db;
+    if (direction == "--convert-to-binary") {
+        loadTextDatabase(inPath, db);
+        if (!writeGalleryFile(outPath, db)) {
+            printError("Failed to write " + outPath);
+            return 1;
+        }
+    } else {
+        MappedGallery source;
+        string error;
+        if (!source.open(inPath, error)) {
+            printError(error);
+            return 1;
+        }
+        loadFromGallery(source, db);
+        if (!saveTextDatabase(outPath, db)) {
+            printError("Failed to write " + outPath);
+            return 1;
+        }
+    }
+    printSuccess("Converted " + to_string(db.size()) + " records to " + outPath);
+    return 0;
+}
+
+// ================== NETWORK VISUALIZATION ==================
+// Connected components ("rings") of the accomplice graph, with edges taken as
+// undirected. Union-find with path halving and union by size; the members of
+// each component form a circular list through nextMember, so listing a ring
+// costs its size and merging two rings is O(1). find() compresses paths as it
+// goes and is for the writer; readers of a published gallery use root().
+struct ComponentIndex {
+    vector<uint32_t> parent, nextMember;
+    vector<uint32_t> size, records, edges;   // meaningful at roots only
+    size_t count = 0;                        // number of components
+
+    uint32_t find(uint32_t v) {
+        while (parent[v] != v) {
+            parent[v] = parent[parent[v]];
+            v = parent[v];
+        }
+        return v;
+    }
+
+    uint32_t root(uint32_t v) const {
+        while (parent[v] != v) v = parent[v];
+        return v;
+    }
+
+    void addVertex(bool isRecord) {
+        uint32_t v = parent.size();
+        parent.push_back(v);
+        nextMember.push_back(v);
+        size.push_back(1);
+        records.push_back(isRecord);
+        edges.push_back(0);
+        count++;
+    }
+
+    void addRecord(uint32_t v) { records[find(v)]++; }
+
+    void addEdge(uint32_t a, uint32_t b) {
+        uint32_t ra = find(a), rb = find(b);
+        if (ra == rb) {
+            edges[ra]++;
+            return;
+        }
+        if (size[ra] < size[rb]) swap(ra, rb);
+        parent[rb] = ra;
+        swap(nextMember[ra], nextMember[rb]);
+        size[ra] += size[rb];
+        records[ra] += records[rb];
+        edges[ra] += edges[rb] + 1;
+        count--;
+    }
+};
+
+// Accomplice graph in compressed sparse row form. A full build numbers criminal
+// IDs (and accomplice IDs with no record) densely in ascending order; records
+// enrolled later append their vertices and edge rows, so vertex numbers never
+// change between builds. Out-edges of v (its accomplice list) are
+// targets[rowBegin[v] .. rowEnd[v]). In-edges come from a reverse CSR over the
+// vertices of the last full build plus lateIn for edges added since.
+struct AccompliceGraph {
+    vector<int> ids;                   // vertex -> criminal ID
+    size_t sortedVertices = 0;         // ids[0, sortedVertices) are ascending
+    unordered_map<int, uint32_t> lateVertices;
+    vector<uint32_t> rowBegin, rowEnd;
+    vector<uint32_t> targets;
+    vector<uint32_t> inOffsets, sources;
+    unordered_map<uint32_t, vector<uint32_t>> lateIn;
+    vector<char> linkedFlags;
+    size_t linked = 0;                 // vertices with at least one edge in or out
+    ComponentIndex components;
+
+    size_t vertices() const { return ids.size(); }
+    size_t edges() const { return targets.size(); }
+
+    // Dense vertex of a criminal ID, or -1
+    int64_t vertexOf(int id) const {
+        auto end = ids.begin() + sortedVertices;
+        auto it = lower_bound(ids.begin(), end, id);
+        if (it != end && *it == id) return it - ids.begin();
+        auto late = lateVertices.find(id);
+        return late != lateVertices.end() ? (int64_t)late->second : -1;
+    }
+
+    const uint32_t* edgesBegin(size_t v) const { return targets.data() + rowBegin[v]; }
+    const uint32_t* edgesEnd(size_t v) const { return targets.data() + rowEnd[v]; }
+    size_t outDegree(size_t v) const { return rowEnd[v] - rowBegin[v]; }
+
+    // Calls visit(u) for every vertex sharing an edge with v, in either direction
+    template <typename Visit>
+    void forEachNeighbor(uint32_t v, const Visit& visit) const {
+        for (const uint32_t* e = edgesBegin(v); e != edgesEnd(v); ++e) visit(*e);
+        if (v < sortedVertices)
+            for (uint32_t i = inOffsets[v]; i < inOffsets[v + 1]; ++i) visit(sources[i]);
+        if (lateIn.empty()) return;
+        auto late = lateIn.find(v);
+        if (late != lateIn.end())
+            for (uint32_t u : late->second) visit(u);
+    }
+
+    uint32_t addVertex(int id, bool isRecord) {
+        uint32_t v = ids.size();
+        ids.push_back(id);
+        lateVertices[id] = v;
+        rowBegin.push_back(0);
+        rowEnd.push_back(0);
+        linkedFlags.push_back(0);
+        components.addVertex(isRecord);
+        return v;
+    }
+
+    void markLinked(uint32_t v) {
+        if (linkedFlags[v]) return;
+        linkedFlags[v] = 1;
+        linked++;
+    }
+
+    // Enrollment: adds the record's vertex and accomplice edges in place. The
+    // ID must not have a record yet (applyUpdates rejects those); its vertex
+    // may exist already as someone's accomplice.
+    void addRecord(const CriminalView& c) {
+        int64_t found = vertexOf(c.id);
+        uint32_t v = found >= 0 ? found : addVertex(c.id, true);
+        if (found >= 0) components.addRecord(v);
+        rowBegin[v] = targets.size();
+        for (int accompliceId : c.accomplices) {
+            int64_t t = vertexOf(accompliceId);
+            uint32_t target = t >= 0 ? t : addVertex(accompliceId, false);
+            targets.push_back(target);
+            lateIn[target].push_back(v);
+            markLinked(v);
+            markLinked(target);
+            components.addEdge(v, target);
+        }
+        rowEnd[v] = targets.size();
+    }
+};
+
+void buildAccompliceGraph(AccompliceGraph& g, const RecordStore& db) {
+    g = AccompliceGraph();
+    for (CriminalView c : db) {
+        g.ids.push_back(c.id);
+        g.ids.insert(g.ids.end(), c.accomplices.begin(), c.accomplices.end());
+    }
+    sort(g.ids.begin(), g.ids.end());
+    g.ids.erase(unique(g.ids.begin(), g.ids.end()), g.ids.end());
+    size_t n = g.vertices();
+    g.sortedVertices = n;
+    g.rowBegin.assign(n, 0);
+    g.rowEnd.assign(n, 0);
+    g.linkedFlags.assign(n, 0);
+    g.inOffsets.assign(n + 1, 0);
+    for (size_t v = 0; v < n; ++v) g.components.addVertex(false);
+
+    // Out rows in ID order, counting in-degrees on the way
+    for (CriminalView c : db) {
+        uint32_t self = g.vertexOf(c.id);
+        g.components.addRecord(self);
+        g.rowBegin[self] = g.targets.size();
+        for (int accompliceId : c.accomplices) {
+            uint32_t target = g.vertexOf(accompliceId);
+            g.targets.push_back(target);
+            g.inOffsets[target + 1]++;
+            g.markLinked(self);
+            g.markLinked(target);
+            g.components.addEdge(self, target);
+        }
+        g.rowEnd[self] = g.targets.size();
+    }
+
+    for (size_t v = 0; v < n; ++v) g.inOffsets[v + 1] += g.inOffsets[v];
+    g.sources.resize(g.targets.size());
+    vector<uint32_t> fill(g.inOffsets.begin(), g.inOffsets.end() - 1);
+    for (size_t v = 0; v < n; ++v)
+        for (const uint32_t* e = g.edgesBegin(v); e != g.edgesEnd(v); ++e) g.sources[fill[*e]++] = v;
+    g.lateVertices.clear();
+}
+
+// Read-only name lookup; accomplice IDs without a record have no name
+string_view criminalName(const RecordStore& db, int id) {
+    CriminalView c;
+    return db.find(id, c) ? c.name : string_view();
+}
+
+// Breadth-first walk from vertex `start`. Fills `order` with the vertices
+// reached, in visit order, and `degree` (indexed by vertex) with their
+// degree of separation; entries for unreached vertices are undefined.
+// The full network follows accomplice lists as recorded (outgoing edges);
+// k-hop neighbourhoods pass undirected and stop at maxDepth.
+void walkNetwork(const AccompliceGraph& g, size_t start, vector<uint32_t>& order, vector<int>& degree,
+                 bool undirected = false, int maxDepth = INT_MAX) {
+    vector<uint64_t> visited((g.vertices() + 63) / 64, 0);
+    degree.resize(g.vertices());
+    order.clear();
+    order.push_back(start);
+    visited[start >> 6] |= 1ULL << (start & 63);
+    degree[start] = 0;
+    for (size_t head = 0; head < order.size(); ++head) {
+        uint32_t current = order[head];
+        if (degree[current] >= maxDepth) break;
+        auto visit = [&](uint32_t next) {
+            uint64_t bit = 1ULL << (next & 63);
+            if (visited[next >> 6] & bit) return;
+            visited[next >> 6] |= bit;
+            degree[next] = degree[current] + 1;
+            order.push_back(next);
+        };
+        if (undirected) {
+            g.forEachNeighbor(current, visit);
+        } else {
+            for (const uint32_t* e = g.edgesBegin(current); e != g.edgesEnd(current); ++e) visit(*e);
+        }
+    }
+}
+
+// Shortest undirected path between two vertices by bidirectional BFS. Each
+// round expands one whole level of the smaller frontier and keeps the best
+// edge joining the two searches in that level, so the path is a shortest one.
+// Only vertices actually reached are stored; `touched` reports how many.
+vector<uint32_t> separationPath(const AccompliceGraph& g, uint32_t from, uint32_t to, size_t& touched) {
+    touched = 1;
+    if (from == to) return vector<uint32_t>(1, from);
+    touched = 0;
+    if (g.components.root(from) != g.components.root(to)) return vector<uint32_t>();
+
+    // Per side: vertex -> (parent towards that side's root, distance)
+    unordered_map<uint32_t, pair<uint32_t, int>> seen[2];
+    vector<uint32_t> frontier[2] = {vector<uint32_t>(1, from), vector<uint32_t>(1, to)};
+    seen[0][from] = make_pair(from, 0);
+    seen[1][to] = make_pair(to, 0);
+    uint32_t joint[2] = {0, 0};   // joining edge: a vertex from each side
+    int best = INT_MAX;
+
+    while (best == INT_MAX && !frontier[0].empty() && !frontier[1].empty()) {
+        int side = frontier[0].size() <= frontier[1].size() ? 0 : 1;
+        vector<uint32_t> next;
+        for (uint32_t current : frontier[side]) {
+            int depth = seen[side][current].second + 1;
+            g.forEachNeighbor(current, [&](uint32_t u) {
+                auto other = seen[1 - side].find(u);
+                if (other != seen[1 - side].end() && depth + other->second.second < best) {
+                    best = depth + other->second.second;
+                    joint[side] = current;
+                    joint[1 - side] = u;
+                }
+                if (seen[side].count(u)) return;
+                seen[side][u] = make_pair(current, depth);
+                next.push_back(u);
+            });
+        }
+        frontier[side].swap(next);
+    }
+    touched = seen[0].size() + seen[1].size();
+    if (best == INT_MAX) return vector<uint32_t>();
+
+    vector<uint32_t> path;
+    for (uint32_t v = joint[0];; v = seen[0][v].first) {
+        path.push_back(v);
+        if (v == from) break;
+    }
+    reverse(path.begin(), path.end());
+    for (uint32_t v = joint[1];; v = seen[1][v].first) {
+        path.push_back(v);
+        if (v == to) break;
+    }
+    return path;
+}
+
+void showAccompliceNetwork(const RecordStore& db, const AccompliceGraph& g, int id) {
+    if (!db.contains(id)) {
+        printError("Criminal not found in database!");
+        return;
+    }
+
+    printHeader("FULL CRIMINAL NETWORK FOR #" + to_string(id) + " (" + string(criminalName(db, id)) + ")");
+    cout << COLOR_MAGENTA << "Network shows all direct and indirect connections\n";
+    cout << "Format: [ID] Name (Connection Degree)\n" << COLOR_RESET;
+
+    vector<uint32_t> order;
+    vector<int> degree;
+    walkNetwork(g, g.vertexOf(id), order, degree);
+
+    for (uint32_t current : order) {
+        cout << "\n" << COLOR_BOLD << "[" << g.ids[current] << "] " << criminalName(db, g.ids[current])
+             << COLOR_RESET << " (Degree: " << degree[current] << ") connected to:\n";
+        for (const uint32_t* e = g.edgesBegin(current); e != g.edgesEnd(current); ++e)
+            cout << "  -> [" << g.ids[*e] << "] " << criminalName(db, g.ids[*e]) << " (Degree: " << degree[*e] << ")\n";
+    }
+
+    cout << "\n" << COLOR_YELLOW << "Network Summary:\n";
+    cout << "- Total criminals in network: " << order.size() << "\n";
+    cout << "- Maximum degree of separation: " << degree[order.back()] << "\n";
+    cout << COLOR_RESET;
+}
+
+void viewAccomplicesAdjacencyList(const RecordStore& db, const AccompliceGraph& g) {
+    int id;
+    cout << "Enter criminal ID: ";
+    cin >> id;
+
+    if (!db.contains(id)) {
+        printError("Invalid criminal ID.");
+        return;
+    }
+
+    printHeader("ADJACENCY LIST FOR CRIMINAL #" + to_string(id) + " (" + string(criminalName(db, id)) + ")");
+
+    size_t v = g.vertexOf(id);
+    if (g.outDegree(v) == 0) {
+        printWarning("No connections found for this criminal.");
+        return;
+    }
+    for (const uint32_t* e = g.edgesBegin(v); e != g.edgesEnd(v); ++e) {
+        int accompliceId = g.ids[*e];
+        cout << "[" << id << "] -> [" << accompliceId << "]";
+        if (db.contains(accompliceId)) {
+            cout << " (" << criminalName(db, accompliceId) << ")";
+        }
+        cout << endl;
+    }
+}
+
+const size_t RING_LISTING = 100;   // members printed before the listing is cut short
+
+// Members of the ring containing vertex v, starting from v itself
+vector<uint32_t> ringMembers(const AccompliceGraph& g, uint32_t v, size_t limit) {
+    const ComponentIndex& c = g.components;
+    vector<uint32_t> members;
+    uint32_t u = v;
+    do {
+        members.push_back(u);
+        u = c.nextMember[u];
+    } while (u != v && members.size() < limit);
+    return members;
+}
+
+void showRing(const RecordStore& db, const AccompliceGraph& g, int id) {
+    uint32_t v = g.vertexOf(id);
+    uint32_t root = g.components.root(v);
+    printHeader("RING OF CRIMINAL #" + to_string(id) + " (" + string(criminalName(db, id)) + ")");
+    cout << COLOR_BOLD << "Members: " << COLOR_RESET << g.components.size[root]
+         << " (" << g.components.records[root] << " with records)\n";
+    cout << COLOR_BOLD << "Connections: " << COLOR_RESET << g.components.edges[root] << "\n";
+    for (uint32_t member : ringMembers(g, v, RING_LISTING))
+        cout << "  [" << g.ids[member] << "] " << criminalName(db, g.ids[member]) << "\n";
+    if (g.components.size[root] > RING_LISTING)
+        cout << "  ... and " << g.components.size[root] - RING_LISTING << " more\n";
+}
+
+void showSeparation(const RecordStore& db, const AccompliceGraph& g, int fromId, int toId) {
+    size_t touched;
+    vector<uint32_t> path = separationPath(g, g.vertexOf(fromId), g.vertexOf(toId), touched);
+    printHeader("SEPARATION #" + to_string(fromId) + " -> #" + to_string(toId));
+    if (path.empty()) {
+        printWarning("These criminals are not connected.");
+        return;
+    }
+    cout << COLOR_BOLD << "Degrees of separation: " << COLOR_RESET << path.size() - 1 << "\n";
+    for (size_t i = 0; i < path.size(); ++i)
+        cout << (i ? "  -> [" : "     [") << g.ids[path[i]] << "] " << criminalName(db, g.ids[path[i]]) << "\n";
+    cout << COLOR_BLUE << "Searched " << touched << " of " << g.components.size[g.components.root(path[0])]
+         << " ring members\n" << COLOR_RESET;
+}
+
+void showWithinHops(const RecordStore& db, const AccompliceGraph& g, int id, int hops) {
+    vector<uint32_t> order;
+    vector<int> degree;
+    walkNetwork(g, g.vertexOf(id), order, degree, true, hops);
+    printHeader("WITHIN " + to_string(hops) + " HOPS OF #" + to_string(id) + " (" + string(criminalName(db, id)) + ")");
+    for (size_t i = 1; i < order.size(); ++i)
+        cout << "  [" << g.ids[order[i]] << "] " << criminalName(db, g.ids[order[i]])
+             << " (Hops: " << degree[order[i]] << ")\n";
+    cout << COLOR_YELLOW << "- Members within " << hops << " hops: " << order.size() - 1 << "\n" << COLOR_RESET;
+}
+
+void showLargestRings(const RecordStore& db, const AccompliceGraph& g, size_t limit) {
+    const ComponentIndex& c = g.components;
+    vector<pair<uint32_t, uint32_t>> rings;   // (size, root)
+    size_t singletons = 0;
+    for (uint32_t v = 0; v < c.parent.size(); ++v) {
+        if (c.parent[v] != v) continue;
+        if (c.size[v] == 1) singletons++;
+        else rings.push_back(make_pair(c.size[v], v));
+    }
+    size_t shown = min(limit, rings.size());
+    partial_sort(rings.begin(), rings.begin() + shown, rings.end(),
+                 [&](const pair<uint32_t, uint32_t>& a, const pair<uint32_t, uint32_t>& b) {
+                     return a.first > b.first || (a.first == b.first && g.ids[a.second] < g.ids[b.second]);
+                 });
+
+    printHeader("LARGEST RINGS");
+    cout << "Rings: " << rings.size() << ", unconnected criminals: " << singletons << "\n";
+    for (size_t i = 0; i < shown; ++i) {
+        uint32_t root = rings[i].second;
+        cout << setw(3) << i + 1 << ". " << c.size[root] << " members (" << c.records[root] << " with records), "
+             << c.edges[root] << " connections, e.g. [" << g.ids[root] << "] " << criminalName(db, g.ids[root]) << "\n";
+    }
+}
+
+bool readCriminalID(const RecordStore& db, const string& prompt, int& id) {
+    cout << prompt;
+    if (!(cin >> id) || !db.contains(id)) {
+        cin.clear();
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        printError("Criminal not found in database!");
+        return false;
+    }
+    return true;
+}
+
+void viewNetworkAnalytics(const RecordStore& db, const AccompliceGraph& g) {
+    printHeader("NETWORK ANALYTICS");
+    cout << "1. Ring (connected group) of a criminal\n";
+    cout << "2. Degrees of separation between two criminals\n";
+    cout << "3. Members within k hops\n";
+    cout << "4. Largest rings\n";
+    cout << "Your choice (1-4): ";
+    int choice, id, other, hops;
+    cin >> choice;
+    switch (choice) {
+        case 1:
+            if (readCriminalID(db, "Enter criminal ID: ", id)) showRing(db, g, id);
+            break;
+        case 2:
+            if (readCriminalID(db, "Enter first criminal ID: ", id) && readCriminalID(db, "Enter second criminal ID: ", other))
+                showSeparation(db, g, id, other);
+            break;
+        case 3:
+            if (!readCriminalID(db, "Enter criminal ID: ", id)) break;
+            cout << "Number of hops: ";
+            if (!(cin >> hops) || hops < 1) {
+                cin.clear();
+                printError("Please enter a positive number!");
+                break;
+            }
+            showWithinHops(db, g, id, hops);
+            break;
+        case 4: showLargestRings(db, g, 10); break;
+        default: printError("Invalid choice!");
+    }
+}
+
+// ================== TRIPLET INDEX ==================
+// Geometric hashing over minutiae triplets. Each minutia is joined with pairs of
+// its nearest neighbours; a triangle is described by its quantized side lengths,
+// each vertex's minutia angle relative to the direction of the centroid, and
+// the vertex types. None of these change under rotation or translation. Keys map
+// to posting lists of gallery templates, and a probe's triangles vote for the
+// templates that share them.
+//
+// Persisted as a header followed by one block per template:
+//   id | template hash | key count | keys
+// A block is only reused if its hash still matches the template, so records
+// enrolled or changed behind the index's back are re-indexed at load.
+const char TRIPLET_INDEX_MAGIC[8] = {'F', 'P', 'T', 'R', 'I', 'D', 'X', '1'};
+const uint32_t TRIPLET_INDEX_VERSION = 1;
+const int TRIPLET_NEIGHBORS = 4;
+const int TRIPLET_SIDE_BIN = 10;      // px per side-length bin
+const int TRIPLET_ANGLE_BINS = 12;    // 30 degree bins
+const size_t TRIPLET_LATE_MIN = 1 << 16; // late postings always allowed before a fold
+size_t indexCandidates = 100;         // top-voted templates rescored by the graph matcher
+
+struct TripletIndexHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t neighbors;
+    int32_t sideBin;
+    int32_t angleBins;
+};
+
+uint64_t tripletKey(const Minutiae* v[3]) {
+    static const double DEGREES = 180.0 / acos(-1.0);
+    double side[3] = {
+        hypot(v[1]->x - v[2]->x, v[1]->y - v[2]->y),
+        hypot(v[0]->x - v[2]->x, v[0]->y - v[2]->y),
+        hypot(v[0]->x - v[1]->x, v[0]->y - v[1]->y)
+    };
+    // Canonical vertex order: by the length of the opposite side
+    int order[3] = {0, 1, 2};
+    sort(order, order + 3, [&](int a, int b) { return side[a] < side[b]; });
+    double cx = (v[0]->x + v[1]->x + v[2]->x) / 3.0;
+    double cy = (v[0]->y + v[1]->y + v[2]->y) / 3.0;
+
+    uint64_t key = 0;
+    for (int k = 0; k < 3; ++k) {
+        const Minutiae& m = *v[order[k]];
+        uint64_t length = min(255, (int)(side[order[k]] / TRIPLET_SIDE_BIN));
+        double relative = fmod(m.angle - atan2(cy - m.y, cx - m.x) * DEGREES + 720.0, 360.0);
+        uint64_t angle = (int)(relative * TRIPLET_ANGLE_BINS / 360.0) % TRIPLET_ANGLE_BINS;
+        key = (key << 13) | (length << 5) | (angle << 1) | (m.type == 'B' ? 1 : 0);
+    }
+    return key;
+}
+
+// Sorted, de-duplicated triplet keys of one template
+vector<uint64_t> tripletKeys(MinutiaeSpan fp) {
+    vector<uint64_t> keys;
+    size_t n = fp.size();
+    if (n < 3) return keys;
+
+    vector<array<uint32_t, 3>> triangles;
+    vector<pair<long long, uint32_t>> byDistance;
+    for (uint32_t i = 0; i < n; ++i) {
+        byDistance.clear();
+        for (uint32_t j = 0; j < n; ++j) {
+            if (j == i) continue;
+            long long dx = fp[i].x - fp[j].x, dy = fp[i].y - fp[j].y;
+            byDistance.push_back(make_pair(dx * dx + dy * dy, j));
+        }
+        size_t k = min<size_t>(TRIPLET_NEIGHBORS, byDistance.size());
+        partial_sort(byDistance.begin(), byDistance.begin() + k, byDistance.end());
+        for (size_t a = 0; a < k; ++a) {
+            for (size_t b = a + 1; b < k; ++b) {
+                array<uint32_t, 3> t = {i, byDistance[a].second, byDistance[b].second};
+                sort(t.begin(), t.end());
+                triangles.push_back(t);
+            }
+        }
+    }
+    sort(triangles.begin(), triangles.end());
+    triangles.erase(unique(triangles.begin(), triangles.end()), triangles.end());
+
+    for (const auto& t : triangles) {
+        const Minutiae* v[3] = {&fp[t[0]], &fp[t[1]], &fp[t[2]]};
+        keys.push_back(tripletKey(v));
+    }
+    sort(keys.begin(), keys.end());
+    keys.erase(unique(keys.begin(), keys.end()), keys.end());
+    return keys;
+}
+
+// FNV-1a over the fields the triplet keys depend on
+uint64_t templateHash(MinutiaeSpan fp) {
+    uint64_t h = 1469598103934665603ull;
+    auto mix = [&](int64_t value) {
+        for (int b = 0; b < 8; ++b) {
+            h ^= (value >> (8 * b)) & 0xFF;
+            h *= 1099511628211ull;
+        }
+    };
+    mix(fp.size());
+    for (const auto& m : fp) {
+        mix(m.x);
+        mix(m.y);
+        mix(m.angle);
+        mix(m.type);
+    }
+    return h;
+}
+
+// Postings hold positions in the gallery's columns, which only change on
+// reload. Copies of an index (one per gallery version) share one immutable
+// set of postings, stored flat: sorted keys with a CSR row of positions each.
+// Positions inserted since it was built sit in `late` until settle() merges
+// them into a new shared set.
+class TripletIndex {
+public:
+    void insert(uint32_t position, const vector<uint64_t>& keys) {
+        for (uint64_t key : keys) late[key].push_back(position);
+        lateEntries += keys.size();
+    }
+
+    // Merges once the late postings reach a 32nd of the shared ones, so a copy
+    // stays cheap and merging costs O(1) amortized per insert
+    void settle(bool force = false) {
+        const Postings& base = *shared;
+        if (late.empty() || (!force && lateEntries < max(TRIPLET_LATE_MIN, base.positions.size() / 32))) return;
+        vector<uint64_t> lateKeys;
+        lateKeys.reserve(late.size());
+        for (const auto& entry : late) lateKeys.push_back(entry.first);
+        sort(lateKeys.begin(), lateKeys.end());
+
+        auto merged = make_shared<Postings>();
+        merged->keys.reserve(base.keys.size() + lateKeys.size());
+        merged->offsets.reserve(base.keys.size() + lateKeys.size() + 1);
+        merged->positions.reserve(base.positions.size() + lateEntries);
+        size_t i = 0, j = 0;
+        while (i < base.keys.size() || j < lateKeys.size()) {
+            uint64_t key = j == lateKeys.size() || (i < base.keys.size() && base.keys[i] < lateKeys[j])
+                               ? base.keys[i] : lateKeys[j];
+            if (i < base.keys.size() && base.keys[i] == key) {
+                merged->positions.insert(merged->positions.end(), base.positions.begin() + base.offsets[i],
+                                         base.positions.begin() + base.offsets[i + 1]);
+                i++;
+            }
+            if (j < lateKeys.size() && lateKeys[j] == key) {
+                const vector<uint32_t>& list = late[key];
+                merged->positions.insert(merged->positions.end(), list.begin(), list.end());
+                j++;
+            }
+            merged->keys.push_back(key);
+            merged->offsets.push_back(merged->positions.size());
+        }
+        shared = move(merged);
+        late.clear();
+        lateEntries = 0;
+    }
+
+    // Full build: keys[i] are the keys of position i
+    void assign(const vector<vector<uint64_t>>& keys) {
+        vector<pair<uint64_t, uint32_t>> entries;
+        for (uint32_t position = 0; position < keys.size(); ++position)
+            for (uint64_t key : keys[position]) entries.emplace_back(key, position);
+        sort(entries.begin(), entries.end());
+        auto built = make_shared<Postings>();
+        built->positions.reserve(entries.size());
+        for (const auto& entry : entries) {
+            if (built->keys.empty() || built->keys.back() != entry.first) {
+                if (!built->keys.empty()) built->offsets.push_back(built->positions.size());
+                built->keys.push_back(entry.first);
+            }
+            built->positions.push_back(entry.second);
+        }
+        if (!built->keys.empty()) built->offsets.push_back(built->positions.size());
+        shared = move(built);
+        late.clear();
+        lateEntries = 0;
+    }
+
+    bool sharesPostings(const TripletIndex& other) const { return shared == other.shared; }
+
+    void clear() {
+        shared = make_shared<Postings>();
+        late.clear();
+        lateEntries = 0;
+    }
+
+    // Gallery positions ordered by votes (then lower ID), at most `limit`
+    vector<uint32_t> candidates(const vector<uint64_t>& probeKeys, const GalleryColumns& g, size_t limit) const {
+        // Keys shared by a large part of the gallery carry no information
+        size_t common = max<size_t>(1000, g.size() / 20);
+        const Postings& base = *shared;
+        unordered_map<uint32_t, int> votes;
+        for (uint64_t key : probeKeys) {
+            auto it = lower_bound(base.keys.begin(), base.keys.end(), key);
+            const uint32_t* first = nullptr;
+            const uint32_t* last = nullptr;
+            if (it != base.keys.end() && *it == key) {
+                first = base.positions.data() + base.offsets[it - base.keys.begin()];
+                last = base.positions.data() + base.offsets[it - base.keys.begin() + 1];
+            }
+            auto lateIt = late.find(key);
+            const vector<uint32_t>* lateList = lateIt != late.end() ? &lateIt->second : nullptr;
+            size_t count = (last - first) + (lateList ? lateList->size() : 0);
+            if (count == 0 || count > common) continue;
+            for (const uint32_t* p = first; p != last; ++p) votes[*p]++;
+            if (lateList)
+                for (uint32_t position : *lateList) votes[position]++;
+        }
+        vector<pair<int, uint32_t>> ranked;
+        ranked.reserve(votes.size());
+        for (const auto& v : votes) ranked.push_back(make_pair(v.second, v.first));
+        auto better = [&](const pair<int, uint32_t>& a, const pair<int, uint32_t>& b) {
+            return a.first > b.first || (a.first == b.first && g.ids[a.second] < g.ids[b.second]);
+        };
+        size_t keep = min(limit, ranked.size());
+        partial_sort(ranked.begin(), ranked.begin() + keep, ranked.end(), better);
+        vector<uint32_t> result;
+        for (size_t i = 0; i < keep; ++i) result.push_back(ranked[i].second);
+        return result;
+    }
+
+private:
+    struct Postings {
+        vector<uint64_t> keys;                               // ascending
+        vector<uint32_t> offsets = vector<uint32_t>(1, 0);   // key i: positions[offsets[i], offsets[i + 1])
+        vector<uint32_t> positions;
+    };
+    shared_ptr<const Postings> shared = make_shared<Postings>();
+    unordered_map<uint64_t, vector<uint32_t>> late;
+    size_t lateEntries = 0;
+};
+
+void writeTripletBlock(ofstream& out, int id, uint64_t hash, const vector<uint64_t>& keys) {
+    int32_t id32 = id;
+    uint32_t count = keys.size();
+    out.write(reinterpret_cast<const char*>(&id32), sizeof(id32));
+    out.write(reinterpret_cast<const char*>(&hash), sizeof(hash));
+    out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    out.write(reinterpret_cast<const char*>(keys.data()), keys.size() * sizeof(uint64_t));
+}
+
+TripletIndexHeader tripletIndexHeader() {
+    TripletIndexHeader h;
+    memcpy(h.magic, TRIPLET_INDEX_MAGIC, sizeof(h.magic));
+    h.version = TRIPLET_INDEX_VERSION;
+    h.neighbors = TRIPLET_NEIGHBORS;
+    h.sideBin = TRIPLET_SIDE_BIN;
+    h.angleBins = TRIPLET_ANGLE_BINS;
+    return h;
+}
+
+// Loads the persisted index, re-indexes (in parallel) any template whose block
+// is missing or stale, and rewrites the file if anything had to be rebuilt.
+void loadTripletIndex(TripletIndex& index, const GalleryColumns& g, const RecordStore& db) {
+    unordered_map<int, size_t> positions;
+    for (size_t i = 0; i < g.size(); ++i) positions[g.ids[i]] = i;
+
+    auto span = [&](size_t i) {
+        return db.view(db.slotOf(g.ids[i])).fingerprint;
+    };
+
+    vector<vector<uint64_t>> keys(g.size());
+    vector<char> loaded(g.size(), 0);
+    size_t staleBlocks = 0;
+
+    ifstream fin(tripletIndexFile, ios::binary);
+    TripletIndexHeader expected = tripletIndexHeader(), header;
+    if (fin.read(reinterpret_cast<char*>(&header), sizeof(header)) &&
+        memcmp(&header, &expected, sizeof(header)) == 0) {
+        int32_t id;
+        uint64_t hash;
+        uint32_t count;
+        while (fin.read(reinterpret_cast<char*>(&id), sizeof(id)) &&
+               fin.read(reinterpret_cast<char*>(&hash), sizeof(hash)) &&
+               fin.read(reinterpret_cast<char*>(&count), sizeof(count))) {
+            vector<uint64_t> blockKeys(count);
+            if (!fin.read(reinterpret_cast<char*>(blockKeys.data()), count * sizeof(uint64_t))) break;
+            auto it = positions.find(id);
+            if (it == positions.end() || templateHash(span(it->second)) != hash) {
+                staleBlocks++;
+                continue;
+            }
+            keys[it->second].swap(blockKeys);
+            if (loaded[it->second]) staleBlocks++; // superseded by a later block
+            loaded[it->second] = 1;
+        }
+    }
+    fin.close();
+
+    vector<size_t> missing;
+    for (size_t i = 0; i < g.size(); ++i)
+        if (!loaded[i]) missing.push_back(i);
+    searchPool().parallelFor(missing.size(), 64, [&](size_t begin, size_t end, unsigned) {
+        for (size_t j = begin; j < end; ++j) keys[missing[j]] = tripletKeys(span(missing[j]));
+    });
+
+    index.assign(keys);
+
+    if (missing.empty() && staleBlocks == 0) return;
+    string tmpPath = tripletIndexFile + ".tmp";
+    ofstream fout(tmpPath, ios::binary | ios::trunc);
+    fout.write(reinterpret_cast<const char*>(&expected), sizeof(expected));
+    for (size_t i = 0; i < g.size(); ++i) writeTripletBlock(fout, g.ids[i], templateHash(span(i)), keys[i]);
+    fout.close();
+    if (!fout) {
+        remove(tmpPath.c_str());
+        printWarning("Could not save triplet index");
+        return;
+    }
+#ifdef _WIN32
+    remove(tripletIndexFile.c_str());
+#endif
+    rename(tmpPath.c_str(), tripletIndexFile.c_str());
+}
+
+// ================== GALLERY SNAPSHOTS ==================
+// Everything a search or lookup reads - records, matcher columns, triplet
+// index and accomplice graph - is one Gallery version. A published version is
+// never modified: readers take it with currentGallery() and hold the pointer
+// for the whole request, so they never see a half-enrolled record, and the
+// version is freed when its last reader lets go of it.
+//
+// Writers are serialized by galleryWriteLock. They build the next version to
+// the side and publish it with an atomic pointer swap, so readers never wait
+// for them. Instead of copying the gallery for every update, the writer keeps
+// the last few versions it replaced together with the updates published since
+// the oldest of them. The newest one no reader holds any more is brought up to
+// date from that log and reused; the live version is only copied when readers
+// still hold all of them. Triplet postings are shared between versions (see
+// TripletIndex), so a copy costs the records, columns and graph only.
+const size_t RETIRED_GALLERIES = 2;
+
+struct Gallery {
+    uint64_t version = 0;
+    bool indexed = false;          // triplets loaded; updates skip them otherwise
+    RecordStore records;
+    GalleryColumns columns;
+    TripletIndex triplets;
+    AccompliceGraph network;
+};
+
+// An enrolled record, with its triplet keys computed once for every version
+struct GalleryUpdate {
+    Criminal record;
+    vector<uint64_t> tripletKeys;
+};
+
+// Appends the updates' blocks to the persisted triplet index in one write
+void saveTripletBlocks(const vector<const GalleryUpdate*>& updates) {
+    ifstream existing(tripletIndexFile, ios::binary);
+    bool fresh = !existing.good();
+    existing.close();
+    ofstream fout(tripletIndexFile, ios::binary | ios::app);
+    if (fresh) {
+        TripletIndexHeader h = tripletIndexHeader();
+        fout.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    }
+    for (const GalleryUpdate* u : updates)
+        writeTripletBlock(fout, u->record.id, templateHash(u->record.fingerprint), u->tripletKeys);
+}
+
+struct RetiredGallery {
+    shared_ptr<Gallery> gallery;
+    uint64_t applied;              // updates it holds, counted since the last load
+};
+
+mutex galleryWriteLock;
+shared_ptr<Gallery> liveGallery = make_shared<Gallery>();   // the published version
+uint64_t liveApplied = 0;
+deque<RetiredGallery> retiredGalleries;                     // oldest first
+deque<GalleryUpdate> galleryLog;                            // updates since the oldest retired version
+uint64_t galleryLogStart = 0;                               // `applied` count before galleryLog.front()
+shared_ptr<const Gallery> publishedGallery = liveGallery;   // atomic_load/atomic_store only
+
+shared_ptr<const Gallery> currentGallery() {
+    return atomic_load(&publishedGallery);
+}
+
+// The records of a gallery version, keeping the whole version alive
+shared_ptr<const RecordStore> galleryRecords(const shared_ptr<const Gallery>& g) {
+    return shared_ptr<const RecordStore>(g, &g->records);
+}
+
+// Columns, postings and the graph can only append, so a batch that repeats an
+// ID or names one already stored is rejected and `g` is left as it was.
+bool applyUpdates(Gallery& g, const vector<const GalleryUpdate*>& updates, bool triplets = true) {
+    unordered_set<int> ids;
+    vector<const Criminal*> records;
+    for (const GalleryUpdate* u : updates) {
+        if (g.records.contains(u->record.id) || !ids.insert(u->record.id).second) return false;
+        records.push_back(&u->record);
+    }
+    g.records.put(records);
+    for (const GalleryUpdate* u : updates) {
+        g.columns.append(u->record.id, u->record.fingerprint);
+        if (triplets && g.indexed) g.triplets.insert(g.columns.size() - 1, u->tripletKeys);
+        g.network.addRecord(g.records.view(g.records.slotOf(u->record.id)));
+    }
+    return true;
+}
+
+// Starts the version after liveGallery; caller holds galleryWriteLock
+shared_ptr<Gallery> nextGallery() {
+    shared_ptr<Gallery> next;
+    for (auto it = retiredGalleries.rbegin(); it != retiredGalleries.rend(); ++it) {
+        if (it->gallery.use_count() != 1) continue;
+        // Pairs with the release in the last reader's reference drop
+        atomic_thread_fence(memory_order_acquire);
+        next = move(it->gallery);
+        uint64_t from = it->applied;
+        retiredGalleries.erase(std::next(it).base());
+        // Replaying postings is only worth it while both still share a base
+        bool sameTriplets = next->triplets.sharesPostings(liveGallery->triplets);
+        vector<const GalleryUpdate*> missed;
+        for (uint64_t i = from; i < liveApplied; ++i) missed.push_back(&galleryLog[i - galleryLogStart]);
+        // A version that cannot take the log is dropped and the live one copied
+        if (!applyUpdates(*next, missed, sameTriplets)) {
+            next.reset();
+            break;
+        }
+        if (!sameTriplets) next->triplets = liveGallery->triplets;
+        break;
+    }
+    if (!next) {
+        next = make_shared<Gallery>(*liveGallery);
+        STAT_ADD(COUNTER_GALLERY_COPIES, 1);
+    }
+    next->version = liveGallery->version + 1;
+    return next;
+}
+
+// Publishes `next`, which is liveGallery plus `updates`; caller holds galleryWriteLock
+void publishGallery(shared_ptr<Gallery> next, vector<GalleryUpdate> updates) {
+    next->triplets.settle();
+    atomic_store(&publishedGallery, shared_ptr<const Gallery>(next));
+    retiredGalleries.push_back(RetiredGallery{move(liveGallery), liveApplied});
+    if (retiredGalleries.size() > RETIRED_GALLERIES) retiredGalleries.pop_front();
+    liveGallery = move(next);
+    liveApplied += updates.size();
+    for (GalleryUpdate& u : updates) galleryLog.push_back(move(u));
+    uint64_t oldest = retiredGalleries.empty() ? liveApplied : retiredGalleries.front().applied;
+    for (; galleryLogStart < oldest; ++galleryLogStart) galleryLog.pop_front();
+    STAT_ADD(COUNTER_GALLERY_VERSIONS, 1);
+}
+
+// Publishes a gallery built from scratch; nothing earlier can be reused for it
+void installGallery(shared_ptr<Gallery> g) {
+    lock_guard<mutex> lock(galleryWriteLock);
+    g->version = liveGallery->version + 1;
+    atomic_store(&publishedGallery, shared_ptr<const Gallery>(g));
+    liveGallery = move(g);
+    liveApplied = 0;
+    retiredGalleries.clear();
+    galleryLog.clear();
+    galleryLogStart = 0;
+}
+
+// Loads the database into a new gallery. The accomplice graph and triplet
+// index can be skipped by callers that never look at them.
+void loadGallery(bool network = true, bool triplets = true) {
+    shared_ptr<Gallery> g = make_shared<Gallery>();
+    loadCriminalDB(g->records, g->columns);
+    if (network) buildAccompliceGraph(g->network, g->records);
+    if (triplets) loadTripletIndex(g->triplets, g->columns, g->records);
+    g->indexed = triplets;
+    installGallery(g);
+}
+
+// ================== MATCHING ALGORITHMS ==================
+// ---- Minutiae pair kernels ----
+// Count gallery minutiae (one template's packed column slice) that pair with a
+// probe point: same type, within 10 px and within 20 degrees. Distances are
+// compared squared and clamped to 11 px per axis first, so every intermediate
+// fits in 16 bits.
+struct PackedProbe {
+    int16_t x, y, angle;
+    uint16_t type;   // 1 for a bifurcation, 0 for a ridge ending, 2 matches nothing packed
+};
+
+// Moves a probe point into a template's packed frame. Coordinates are clamped
+// to [-16, 32767]: beyond the packed range [0, PACKED_SPAN] that keeps them
+// more than 10 px from every stored point, as they were. The angle is clamped
+// to [-400, 911], where its difference to any packed angle (0..511) stays past
+// 340 degrees, which pairs exactly as the unclamped difference does.
+PackedProbe packedProbe(const Minutiae& probe, int32_t originX, int32_t originY) {
+    PackedProbe p;
+    p.x = (int16_t)max<int64_t>(-16, min<int64_t>(32767, (int64_t)probe.x - originX));
+    p.y = (int16_t)max<int64_t>(-16, min<int64_t>(32767, (int64_t)probe.y - originY));
+    p.angle = (int16_t)max(-400, min(911, probe.angle));
+    p.type = probe.type == 'B' ? 1 : probe.type == 'R' ? 0 : 2;
+    return p;
+}
+
+typedef int (*PairKernel)(const PackedProbe& probe, const int16_t* xs, const int16_t* ys,
+                          const uint16_t* angleTypes, size_t n);
+
+int countPairMatchesScalar(const PackedProbe& probe, const int16_t* xs, const int16_t* ys,
+                           const uint16_t* angleTypes, size_t n) {
+    int matches = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (angleTypes[i] >> 15 != probe.type) continue;
+        int dx = min(abs(probe.x - xs[i]), 11);
+        int dy = min(abs(probe.y - ys[i]), 11);
+        if (dx * dx + dy * dy > 100) continue;
+        int angleDiff = abs(probe.angle - (angleTypes[i] & PACKED_ANGLE_MASK));
+        if (min(angleDiff, 360 - angleDiff) <= 20) matches++;
+    }
+    return matches;
+}
+
+// Unpacked templates (GalleryColumns::wide) are scored straight from the record
+int countPairMatchesExact(const Minutiae& probe, const vector<Minutiae>& fp) {
+    int matches = 0;
+    for (const auto& m : fp) {
+        if (m.type != probe.type) continue;
+        int dx = min(abs(probe.x - m.x), 11);
+        int dy = min(abs(probe.y - m.y), 11);
+        if (dx * dx + dy * dy > 100) continue;
+        int angleDiff = abs(probe.angle - m.angle);
+        if (min(angleDiff, 360 - angleDiff) <= 20) matches++;
+    }
+    return matches;
+}
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define FP_HAVE_X86_KERNELS 1
+#include <immintrin.h>
+
+__attribute__((target("sse4.1")))
+int countPairMatchesSSE(const PackedProbe& probe, const int16_t* xs, const int16_t* ys,
+                        const uint16_t* angleTypes, size_t n) {
+    const __m128i px = _mm_set1_epi16(probe.x), py = _mm_set1_epi16(probe.y);
+    const __m128i pa = _mm_set1_epi16(probe.angle), pt = _mm_set1_epi16(probe.type);
+    const __m128i clamp = _mm_set1_epi16(11), radius2 = _mm_set1_epi16(100);
+    const __m128i fullTurn = _mm_set1_epi16(360), tolerance = _mm_set1_epi16(20);
+    const __m128i angleMask = _mm_set1_epi16(PACKED_ANGLE_MASK), ones = _mm_set1_epi16(1);
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i dx = _mm_min_epi16(_mm_abs_epi16(_mm_sub_epi16(px, _mm_loadu_si128((const __m128i*)(xs + i)))), clamp);
+        __m128i dy = _mm_min_epi16(_mm_abs_epi16(_mm_sub_epi16(py, _mm_loadu_si128((const __m128i*)(ys + i)))), clamp);
+        __m128i d2 = _mm_add_epi16(_mm_mullo_epi16(dx, dx), _mm_mullo_epi16(dy, dy));
+        __m128i at = _mm_loadu_si128((const __m128i*)(angleTypes + i));
+        __m128i da = _mm_abs_epi16(_mm_sub_epi16(pa, _mm_and_si128(at, angleMask)));
+        da = _mm_min_epi16(da, _mm_sub_epi16(fullTurn, da));
+        __m128i reject = _mm_or_si128(_mm_cmpgt_epi16(d2, radius2), _mm_cmpgt_epi16(da, tolerance));
+        __m128i hit = _mm_andnot_si128(reject, _mm_cmpeq_epi16(_mm_srli_epi16(at, 15), pt));
+        acc = _mm_sub_epi32(acc, _mm_madd_epi16(hit, ones)); // hit lanes are -1; pairs summed into 32 bits
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(acc) +
+           countPairMatchesScalar(probe, xs + i, ys + i, angleTypes + i, n - i);
+}
+
+__attribute__((target("avx2")))
+int countPairMatchesAVX2(const PackedProbe& probe, const int16_t* xs, const int16_t* ys,
+                         const uint16_t* angleTypes, size_t n) {
+    const __m256i px = _mm256_set1_epi16(probe.x), py = _mm256_set1_epi16(probe.y);
+    const __m256i pa = _mm256_set1_epi16(probe.angle), pt = _mm256_set1_epi16(probe.type);
+    const __m256i clamp = _mm256_set1_epi16(11), radius2 = _mm256_set1_epi16(100);
+    const __m256i fullTurn = _mm256_set1_epi16(360), tolerance = _mm256_set1_epi16(20);
+    const __m256i angleMask = _mm256_set1_epi16(PACKED_ANGLE_MASK), ones = _mm256_set1_epi16(1);
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i dx = _mm256_min_epi16(_mm256_abs_epi16(_mm256_sub_epi16(px, _mm256_loadu_si256((const __m256i*)(xs + i)))), clamp);
+        __m256i dy = _mm256_min_epi16(_mm256_abs_epi16(_mm256_sub_epi16(py, _mm256_loadu_si256((const __m256i*)(ys + i)))), clamp);
+        __m256i d2 = _mm256_add_epi16(_mm256_mullo_epi16(dx, dx), _mm256_mullo_epi16(dy, dy));
+        __m256i at = _mm256_loadu_si256((const __m256i*)(angleTypes + i));
+        __m256i da = _mm256_abs_epi16(_mm256_sub_epi16(pa, _mm256_and_si256(at, angleMask)));
+        da = _mm256_min_epi16(da, _mm256_sub_epi16(fullTurn, da));
+        __m256i reject = _mm256_or_si256(_mm256_cmpgt_epi16(d2, radius2), _mm256_cmpgt_epi16(da, tolerance));
+        __m256i hit = _mm256_andnot_si256(reject, _mm256_cmpeq_epi16(_mm256_srli_epi16(at, 15), pt));
+        acc = _mm256_sub_epi32(acc, _mm256_madd_epi16(hit, ones));
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum) +
+           countPairMatchesScalar(probe, xs + i, ys + i, angleTypes + i, n - i);
+}
+#endif
+
+// Picks the widest kernel the CPU supports; FP_SIMD=scalar|sse|avx2 overrides it
+PairKernel selectPairKernel(string& name) {
+    const char* forced = getenv("FP_SIMD");
+    string wanted = forced ? forced : "";
+#ifdef FP_HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if ((wanted.empty() || wanted == "avx2") && __builtin_cpu_supports("avx2")) {
+        name = "avx2";
+        return countPairMatchesAVX2;
+    }
+    if ((wanted.empty() || wanted == "sse") && __builtin_cpu_supports("sse4.1")) {
+        name = "sse4.1";
+        return countPairMatchesSSE;
+    }
+#endif
+    name = "scalar";
+    return countPairMatchesScalar;
+}
+
+string pairKernelName;
+PairKernel pairKernel = selectPairKernel(pairKernelName);
+
+// Only the three cell rows around the probe point are handed to the kernel, so
+// the cost per probe point no longer grows with the template size.
+int countPairMatches(const Minutiae& probe, const GalleryColumns& g, size_t index) {
+    size_t first = g.first(index);
+    size_t n = g.length(index);
+    if (!g.wide.empty()) {
+        auto it = g.wide.find(index);
+        if (it != g.wide.end()) {
+            STAT_ADD(COUNTER_MINUTIAE_PAIRS, n);
+            return countPairMatchesExact(probe, it->second);
+        }
+    }
+    PackedProbe packed = packedProbe(probe, g.originX[index], g.originY[index]);
+    auto scan = [&](size_t begin, size_t end) {
+        STAT_ADD(COUNTER_MINUTIAE_PAIRS, end - begin);
+        return pairKernel(packed, g.xs.data() + first + begin, g.ys.data() + first + begin,
+                          g.angleTypes.data() + first + begin, end - begin);
+    };
+    if (n < GRID_MIN_POINTS) return scan(0, n);
+
+    const uint32_t* keys = g.cellKeys.data() + g.cellOffsets[index];
+    const uint16_t* starts = g.cellStarts.data() + g.cellOffsets[index];
+    size_t cells = g.cellOffsets[index + 1] - g.cellOffsets[index];
+    int cx = gridCoord(packed.x), cy = gridCoord(packed.y);
+    int matches = 0;
+    for (int dy = -1; dy <= 1; ++dy) {
+        size_t a = lower_bound(keys, keys + cells, cellKey(cx - 1, cy + dy)) - keys;
+        size_t b = upper_bound(keys + a, keys + cells, cellKey(cx + 1, cy + dy)) - keys;
+        if (a == b) continue;
+        matches += scan(starts[a], b < cells ? starts[b] : n);
+    }
+    return matches;
+}
+
+double compareGraphBasedMatching(MinutiaeSpan fp1, MinutiaeSpan fp2) {
+    STAT_ADD(COUNTER_MINUTIAE_PAIRS, fp1.size() * fp2.size());
+    int matches = 0;
+    for (auto& m1 : fp1) {
+        for (auto& m2 : fp2) {
+            if (m1.type != m2.type) continue;
+            double dist = hypot(m1.x - m2.x, m1.y - m2.y);
+            double angleDiff = min(abs(m1.angle - m2.angle), 360 - abs(m1.angle - m2.angle));
+            if (dist <= 10 && angleDiff <= 20) matches++;
+        }
+    }
+    return 1.0 - (double)matches / max(fp1.size(), fp2.size());
+}
+
+// Same score as above with the gallery side read from the column store
+double compareGraphBasedMatching(MinutiaeSpan probe, const GalleryColumns& g, size_t index) {
+    int matches = 0;
+    for (const auto& m1 : probe) matches += countPairMatches(m1, g, index);
+    return 1.0 - (double)matches / max(probe.size(), g.length(index));
+}
+
+// Bins minutiae into ZONE_SIZE cells anchored at the bounding box corner in a
+// single pass, then keeps the MAX_ZONES fullest cells. Cells come out in the
+// same row-major order as the old per-cell scan (a cell only exists while its
+// corner is below the max coordinate on each axis), so the count sort ranks
+// them exactly as before.
+vector<Zone> createZones(MinutiaeSpan fingerprint) {
+    STAT_TIMER(TIMER_ZONES);
     vector<Zone> zones;
     int min_x = INT_MAX, max_x = INT_MIN;
     int min_y = INT_MAX, max_y = INT_MIN;
 
-    for (const auto& m : fingerprint) {
-        min_x = min(min_x, m.x);
-        max_x = max(max_x, m.x);
-        min_y = min(min_y, m.y);
-        max_y = max(max_y, m.y);
+    for (const auto& m : fingerprint) {
+        min_x = min(min_x, m.x);
+        max_x = max(max_x, m.x);
+        min_y = min(min_y, m.y);
+        max_y = max(max_y, m.y);
+    }
+    if (fingerprint.empty() || max_x <= min_x || max_y <= min_y) return zones;
+
+    int64_t columns = ((int64_t)max_x - min_x + ZONE_SIZE - 1) / ZONE_SIZE;
+    int64_t rows = ((int64_t)max_y - min_y + ZONE_SIZE - 1) / ZONE_SIZE;
+    vector<pair<int64_t, uint32_t>> binned; // (row-major cell, minutia index)
+    binned.reserve(fingerprint.size());
+    for (size_t i = 0; i < fingerprint.size(); ++i) {
+        int64_t cx = ((int64_t)fingerprint[i].x - min_x) / ZONE_SIZE;
+        int64_t cy = ((int64_t)fingerprint[i].y - min_y) / ZONE_SIZE;
+        if (cx < columns && cy < rows) binned.push_back(make_pair(cy * columns + cx, (uint32_t)i));
+    }
+    sort(binned.begin(), binned.end());
+
+    for (size_t i = 0; i < binned.size();) {
+        int64_t cell = binned[i].first;
+        double orientationSum = 0;
+        int count = 0;
+        for (; i < binned.size() && binned[i].first == cell; ++i) {
+            orientationSum += fingerprint[binned[i].second].orientation;
+            count++;
+        }
+        Zone zone;
+        zone.x_center = min_x + (int)(cell % columns) * ZONE_SIZE + ZONE_SIZE/2;
+        zone.y_center = min_y + (int)(cell / columns) * ZONE_SIZE + ZONE_SIZE/2;
+        zone.avgOrientation = orientationSum / count;
+        zone.count = count;
+        zones.push_back(zone);
+    }
+
+    sort(zones.begin(), zones.end(), [](const Zone& a, const Zone& b) {
+        return a.count > b.count;
+    });
+
+    if (zones.size() > MAX_ZONES) zones.resize(MAX_ZONES);
+    return zones;
+}
+
+// Zone-by-zone comparison. When bound is finite, scoring stops (pruned = true)
+// as soon as even perfect scores for the remaining zones could not bring the
+// result down to bound; each zone contributes at most 1 to totalScore.
+template <typename GalleryZone>
+double scoreZones(const Zone* zones1, size_t count1, const GalleryZone* zones2, size_t count2,
+                  double bound, bool& pruned) {
+    double totalScore = 0;
+    int comparedZones = 0;
+    size_t remaining = count1;
+    pruned = false;
+
+    for (const Zone* zone1 = zones1; zone1 != zones1 + count1; ++zone1) {
+        remaining--;
+        for (const GalleryZone* zone2 = zones2; zone2 != zones2 + count2; ++zone2) {
+            double dist = hypot(zone1->x_center - zone2->x_center, 
+                               zone1->y_center - zone2->y_center);
+            if (dist > ZONE_SIZE * 1.5) continue;
+            
+            double orientationDiff = min(
+                abs(zone1->avgOrientation - zone2->avgOrientation),
+                360 - abs(zone1->avgOrientation - zone2->avgOrientation)
+            );
+            
+            double countRatio = min(
+                zone1->count / (double)zone2->count,
+                zone2->count / (double)zone1->count
+            );
+            
+            double zoneScore = (1 - orientationDiff/180.0) * countRatio;
+            totalScore += zoneScore;
+            comparedZones++;
+            break;
+        }
+
+        double bestCase = comparedZones + remaining > 0
+            ? 1.0 - (totalScore + remaining) / (comparedZones + remaining) : 1.0;
+        if (bestCase > bound + 1e-9) {
+            pruned = true;
+            return bestCase;
+        }
+    }
+    
+    return comparedZones > 0 ? (1.0 - totalScore/comparedZones) : 1.0;
+}
+
+double compareZonalMatching(MinutiaeSpan fp1, MinutiaeSpan fp2) {
+    vector<Zone> zones1 = createZones(fp1);
+    vector<Zone> zones2 = createZones(fp2);
+    bool pruned;
+    return scoreZones(zones1.data(), zones1.size(), zones2.data(), zones2.size(),
+                      numeric_limits<double>::infinity(), pruned);
+}
+
+// Probe zones against the descriptors cached for gallery template `index`
+double compareZonalMatching(const vector<Zone>& probeZones, const GalleryColumns& g, size_t index,
+                            double bound, bool& pruned) {
+    return scoreZones(probeZones.data(), probeZones.size(), g.zonesOf(index), g.zoneCount(index),
+                      bound, pruned);
+}
+
+// ================== SEARCH ENGINE ==================
+struct SearchHit {
+    double score;          // lower is better
+    int id;
+    int ridgeMatches;
+    int bifurcationMatches;
+    size_t index;          // position in the gallery's columns
+};
+
+enum MatchMethod {
+    METHOD_GRAPH = 1,
+    METHOD_ZONAL = 2,
+    METHOD_CASCADE = 3,
+    METHOD_INDEXED = 4
+};
+
+const char* methodName(int method) {
+    switch (method) {
+        case METHOD_GRAPH: return "graph";
+        case METHOD_ZONAL: return "zonal";
+        case METHOD_CASCADE: return "cascade";
+        default: return "indexed";
+    }
+}
+
+int methodFromName(const string& name) {
+    for (int method = METHOD_GRAPH; method <= METHOD_INDEXED; ++method)
+        if (name == methodName(method)) return method;
+    return -1;
+}
+
+// Strict ordering used by every search path: lower score first, ties to the
+// lower ID. This makes the parallel merge identical to a serial ID-order scan.
+bool betterHit(const SearchHit& a, const SearchHit& b) {
+    return a.score < b.score || (a.score == b.score && a.id < b.id);
+}
+
+// Bounded candidate list. Only hits scoring below `limit` are admitted; once k
+// hits are held, bound() is the score a candidate must reach to get in, which
+// the matchers use to abandon hopeless candidates early.
+class TopKHits {
+public:
+    TopKHits(size_t k, double limit) : k(max<size_t>(1, k)), limit(limit) {}
+
+    double bound() const { return heap.size() < k ? limit : heap.front().score; }
+
+    void offer(const SearchHit& hit) {
+        if (!(hit.score < limit)) return;
+        if (heap.size() < k) {
+            heap.push_back(hit);
+            push_heap(heap.begin(), heap.end(), betterHit);
+        } else if (betterHit(hit, heap.front())) {
+            pop_heap(heap.begin(), heap.end(), betterHit);
+            heap.back() = hit;
+            push_heap(heap.begin(), heap.end(), betterHit);
+        }
+    }
+
+    void merge(const TopKHits& other) {
+        for (const auto& hit : other.heap) offer(hit);
+    }
+
+    vector<SearchHit> ranked() const {
+        vector<SearchHit> hits = heap;
+        sort(hits.begin(), hits.end(), betterHit);
+        return hits;
+    }
+
+private:
+    size_t k;
+    double limit;
+    vector<SearchHit> heap; // max-heap under betterHit: front() is the weakest kept hit
+};
+
+struct SearchResult {
+    vector<SearchHit> hits;  // best first
+    size_t scored = 0;       // candidates scored to completion
+    size_t pruned = 0;       // candidates abandoned by the score bound
+    size_t shortlisted = 0;  // cascade/indexed: candidates passed to the graph stage
+};
+
+struct alignas(64) SlotResult {
+    TopKHits top;
+    size_t scored = 0;
+    size_t pruned = 0;
+
+    SlotResult(size_t k, double limit) : top(k, limit) {}
+};
+
+const size_t SEARCH_CHUNK = 256;   // gallery templates per work item
+const size_t MAX_CANDIDATES = 50;
+
+size_t cascadeShortlist = 200;     // zonal survivors rescored by the graph matcher
+unsigned cascadeAuditEvery = 20;   // also run a full graph search every Nth cascade query (0 = never)
+
+// Shortlist quality of the cascade. An audited query counts as a miss when the
+// full graph search found a better score than any candidate in the shortlist.
+struct CascadeStats {
+    atomic<uint64_t> queries{0};
+    atomic<uint64_t> shortlisted{0};
+    atomic<uint64_t> audited{0};
+    atomic<uint64_t> missed{0};
+};
+
+CascadeStats cascadeStats;
+
+// Graph-based matching: a test point counts once if any gallery minutia pairs
+// with it. Returns false as soon as the remaining test points could no longer
+// pull the score down to `bound`.
+bool scoreGraphCandidate(MinutiaeSpan testPrint, const GalleryColumns& g, size_t index,
+                         double bound, SearchHit& hit) {
+    hit = SearchHit{0.0, g.ids[index], 0, 0, index};
+    double denominator = max(testPrint.size(), g.length(index));
+    int matches = 0;
+    size_t remaining = testPrint.size();
+    for (auto& m1 : testPrint) {
+        remaining--;
+        if (countPairMatches(m1, g, index) == 0) {
+            if (1.0 - (matches + remaining) / denominator > bound) return false;
+            continue;
+        }
+        matches++;
+        if (m1.type == 'R') hit.ridgeMatches++;
+        else hit.bifurcationMatches++;
+    }
+    hit.score = 1.0 - (double)matches / denominator;
+    return true;
+}
+
+// Zonal-based matching against the descriptors cached for gallery template `index`
+bool scoreZonalCandidate(const vector<Zone>& probeZones, const GalleryColumns& g, size_t index,
+                         double bound, SearchHit& hit) {
+    bool pruned;
+    double score = compareZonalMatching(probeZones, g, index, bound, pruned);
+    hit = SearchHit{score, g.ids[index], 0, 0, index};
+    return !pruned;
+}
+
+// Scores `count` candidates for each of `queries` probes across the worker
+// pool. score(q, i, bound, hit) fills in candidate i for probe q or returns
+// false once it cannot reach bound. Every gallery chunk is visited once for all
+// probes, so a batch shares the memory traffic of a single scan. Each thread
+// keeps its own top-k list per probe and prunes against its own bound; the
+// lists are merged with betterHit() at the end, so every result equals a
+// serial scan.
+template <typename ScoreFn>
+vector<SearchResult> rankCandidatesBatch(size_t count, size_t queries, size_t k, double limit,
+                                         const ScoreFn& score) {
+    WorkerPool& pool = searchPool();
+    vector<SlotResult> local(pool.size() * queries, SlotResult(k, limit));
+    pool.parallelFor(count, SEARCH_CHUNK, [&](size_t begin, size_t end, unsigned slot) {
+        STAT_TIMER(TIMER_SCORING);
+        SearchHit hit;
+        size_t pruned = 0;
+        for (size_t i = begin; i < end; ++i) {
+            for (size_t q = 0; q < queries; ++q) {
+                SlotResult& out = local[slot * queries + q];
+                if (!score(q, i, out.top.bound(), hit)) {
+                    out.pruned++;
+                    pruned++;
+                    continue;
+                }
+                out.scored++;
+                out.top.offer(hit);
+            }
+        }
+        STAT_ADD(COUNTER_CANDIDATES_SCORED, (end - begin) * queries - pruned);
+        STAT_ADD(COUNTER_CANDIDATES_PRUNED, pruned);
+    });
+
+    vector<SearchResult> results(queries);
+    for (size_t q = 0; q < queries; ++q) {
+        TopKHits merged(k, limit);
+        for (unsigned slot = 0; slot < pool.size(); ++slot) {
+            const SlotResult& part = local[slot * queries + q];
+            merged.merge(part.top);
+            results[q].scored += part.scored;
+            results[q].pruned += part.pruned;
+        }
+        results[q].hits = merged.ranked();
+    }
+    return results;
+}
+
+template <typename ScoreFn>
+SearchResult rankCandidates(size_t count, size_t k, double limit, const ScoreFn& score) {
+    return rankCandidatesBatch(count, 1, k, limit,
+        [&](size_t, size_t i, double bound, SearchHit& hit) { return score(i, bound, hit); })[0];
+}
+
+SearchResult searchGraph(const Gallery& g, const vector<Minutiae>& testPrint, size_t k) {
+    return rankCandidates(g.columns.size(), k, numeric_limits<double>::infinity(),
+        [&](size_t i, double bound, SearchHit& hit) {
+            return scoreGraphCandidate(testPrint, g.columns, i, bound, hit);
+        });
+}
+
+// Graph search for several probes in one pass over the gallery
+vector<SearchResult> searchGraphBatch(const Gallery& g, const vector<const vector<Minutiae>*>& probes, size_t k) {
+    return rankCandidatesBatch(g.columns.size(), probes.size(), k, numeric_limits<double>::infinity(),
+        [&](size_t q, size_t i, double bound, SearchHit& hit) {
+            return scoreGraphCandidate(*probes[q], g.columns, i, bound, hit);
+        });
+}
+
+// Zonal scores of 1.0 mean "no zones compared" and are only kept when limit allows
+SearchResult searchZonal(const Gallery& g, const vector<Minutiae>& testPrint, size_t k, double limit) {
+    // Probe zones are built once per query
+    vector<Zone> probeZones = createZones(testPrint);
+    return rankCandidates(g.columns.size(), k, limit,
+        [&](size_t i, double bound, SearchHit& hit) {
+            return scoreZonalCandidate(probeZones, g.columns, i, bound, hit);
+        });
+}
+
+// Coarse-to-fine: rank the whole gallery with the cheap zonal comparison, then
+// rescore only the best cascadeShortlist candidates with the graph matcher.
+SearchResult searchCascade(const Gallery& g, const vector<Minutiae>& testPrint, size_t k) {
+    // A probe without zones would give every candidate the same zonal score
+    if (createZones(testPrint).empty()) return searchGraph(g, testPrint, k);
+
+    SearchResult coarse = searchZonal(g, testPrint, max(cascadeShortlist, k),
+                                      numeric_limits<double>::infinity());
+    const vector<SearchHit>& shortlist = coarse.hits;
+    SearchResult result = rankCandidates(shortlist.size(), k, numeric_limits<double>::infinity(),
+        [&](size_t j, double bound, SearchHit& hit) {
+            return scoreGraphCandidate(testPrint, g.columns, shortlist[j].index, bound, hit);
+        });
+    result.scored += coarse.scored;
+    result.pruned += coarse.pruned;
+    result.shortlisted = shortlist.size();
+
+    uint64_t query = ++cascadeStats.queries;
+    cascadeStats.shortlisted += shortlist.size();
+    if (cascadeAuditEvery && query % cascadeAuditEvery == 0) {
+        SearchResult full = searchGraph(g, testPrint, 1);
+        cascadeStats.audited++;
+        if (!full.hits.empty() && (result.hits.empty() || result.hits[0].score > full.hits[0].score))
+            cascadeStats.missed++;
+    }
+    return result;
+}
+
+// Sublinear retrieval: only the templates sharing the most triplet keys with
+// the probe are scored by the graph matcher
+SearchResult searchIndexed(const Gallery& g, const vector<Minutiae>& testPrint, size_t k) {
+    vector<uint64_t> keys = tripletKeys(testPrint);
+    if (keys.empty()) return searchGraph(g, testPrint, k);
+
+    vector<uint32_t> shortlist = g.triplets.candidates(keys, g.columns, max(indexCandidates, k));
+    SearchResult result = rankCandidates(shortlist.size(), k, numeric_limits<double>::infinity(),
+        [&](size_t j, double bound, SearchHit& hit) {
+            return scoreGraphCandidate(testPrint, g.columns, shortlist[j], bound, hit);
+        });
+    result.shortlisted = shortlist.size();
+    return result;
+}
+
+SearchResult searchGallery(const Gallery& g, const vector<Minutiae>& testPrint, int method, size_t k) {
+    STAT_QUERY(method, testPrint.size(), g.columns.size());
+    switch (method) {
+        case METHOD_GRAPH: return searchGraph(g, testPrint, k);
+        case METHOD_ZONAL: return searchZonal(g, testPrint, k, 1.0);
+        case METHOD_CASCADE: return searchCascade(g, testPrint, k);
+        default: return searchIndexed(g, testPrint, k);
+    }
+}
+
+// ================== PROBE CACHE ==================
+// Results of recently searched probes, least recently used dropped first. A
+// probe is keyed by its minutiae in sorted order, so a resubmission listing
+// the points in another order still hits, plus the method and the parameters
+// that shape its result. All entries belong to one gallery version: the first
+// search against a newer version empties the cache, and searches against an
+// older one bypass it, so a cached result is never stale.
+size_t probeCacheEntries = 1024;   // 0 disables the cache
+
+bool minutiaeBefore(const Minutiae& a, const Minutiae& b) {
+    return tie(a.x, a.y, a.angle, a.type, a.orientation) < tie(b.x, b.y, b.angle, b.type, b.orientation);
+}
+
+bool sameMinutiae(const vector<Minutiae>& a, const vector<Minutiae>& b) {
+    return a.size() == b.size() && equal(a.begin(), a.end(), b.begin(), [](const Minutiae& p, const Minutiae& q) {
+        return p.x == q.x && p.y == q.y && p.angle == q.angle && p.type == q.type && p.orientation == q.orientation;
+    });
+}
+
+struct ProbeKey {
+    vector<Minutiae> minutiae;   // sorted with minutiaeBefore
+    int method;
+    size_t k;
+    size_t shortlist;            // cascadeShortlist or indexCandidates, 0 otherwise
+    uint64_t hash;
+
+    bool operator==(const ProbeKey& o) const {
+        return hash == o.hash && method == o.method && k == o.k && shortlist == o.shortlist &&
+               sameMinutiae(minutiae, o.minutiae);
+    }
+};
+
+ProbeKey probeKey(const vector<Minutiae>& probe, int method, size_t k) {
+    ProbeKey key{probe, method, k, 0, 1469598103934665603ull};
+    sort(key.minutiae.begin(), key.minutiae.end(), minutiaeBefore);
+    if (method == METHOD_CASCADE) key.shortlist = cascadeShortlist;
+    if (method == METHOD_INDEXED) key.shortlist = indexCandidates;
+    // FNV-1a over every field, orientation by its bit pattern
+    auto mix = [&](uint64_t value) {
+        for (int b = 0; b < 8; ++b) {
+            key.hash ^= (value >> (8 * b)) & 0xFF;
+            key.hash *= 1099511628211ull;
+        }
+    };
+    mix(method);
+    mix(k);
+    mix(key.shortlist);
+    for (const auto& m : key.minutiae) {
+        uint64_t orientation;
+        memcpy(&orientation, &m.orientation, sizeof(orientation));
+        mix((uint64_t)(uint32_t)m.x << 32 | (uint32_t)m.y);
+        mix((uint64_t)(uint32_t)m.angle << 8 | (unsigned char)m.type);
+        mix(orientation);
+    }
+    return key;
+}
+
+struct ProbeCacheStats {
+    uint64_t lookups = 0;
+    uint64_t hits = 0;
+    uint64_t evicted = 0;        // dropped to stay within probeCacheEntries
+    uint64_t invalidated = 0;    // dropped because the gallery changed
+    size_t entries = 0;
+};
+
+class ProbeCache {
+public:
+    bool find(const ProbeKey& key, uint64_t version, SearchResult& result) {
+        // A disabled cache is not consulted, so it reports no lookups
+        if (probeCacheEntries == 0) return false;
+        lock_guard<mutex> lock(cacheLock);
+        stats.lookups++;
+        if (!current(version)) return false;
+        auto it = byHash.find(key.hash);
+        if (it == byHash.end() || !(it->second->key == key)) return false;
+        entries.splice(entries.begin(), entries, it->second);
+        result = it->second->result;
+        stats.hits++;
+        return true;
+    }
+
+    void store(ProbeKey key, uint64_t version, const SearchResult& result) {
+        lock_guard<mutex> lock(cacheLock);
+        if (probeCacheEntries == 0 || !current(version)) return;
+        auto it = byHash.find(key.hash);
+        if (it != byHash.end()) {
+            entries.erase(it->second);
+            byHash.erase(it);
+        }
+        uint64_t hash = key.hash;
+        entries.push_front(Entry{move(key), result});
+        byHash[hash] = entries.begin();
+        while (entries.size() > probeCacheEntries) {
+            byHash.erase(entries.back().key.hash);
+            entries.pop_back();
+            stats.evicted++;
+        }
+    }
+
+    ProbeCacheStats snapshot() {
+        lock_guard<mutex> lock(cacheLock);
+        ProbeCacheStats s = stats;
+        s.entries = entries.size();
+        return s;
+    }
+
+private:
+    struct Entry {
+        ProbeKey key;
+        SearchResult result;
+    };
+
+    // Moves the cache to `version` if it is newer; false if it is older
+    bool current(uint64_t version) {
+        if (version < epoch) return false;
+        if (version > epoch) {
+            stats.invalidated += entries.size();
+            entries.clear();
+            byHash.clear();
+            epoch = version;
+        }
+        return true;
+    }
+
+    mutex cacheLock;
+    list<Entry> entries;   // most recently used first
+    unordered_map<uint64_t, list<Entry>::iterator> byHash;
+    uint64_t epoch = 0;    // gallery version of every entry
+    ProbeCacheStats stats;
+};
+
+ProbeCache probeCache;
+
+// searchGallery() behind the probe cache; `cached` tells whether it was a hit
+SearchResult cachedSearch(const Gallery& g, const vector<Minutiae>& probe, int method, size_t k,
+                          bool* cached = nullptr) {
+    ProbeKey key = probeKey(probe, method, k);
+    SearchResult result;
+    bool hit = probeCache.find(key, g.version, result);
+    if (!hit) {
+        result = searchGallery(g, probe, method, k);
+        probeCache.store(move(key), g.version, result);
+    }
+    if (cached) *cached = hit;
+    return result;
+}
+
+// ================== CORE FUNCTIONS ==================
+// Journals every valid update of the batch with one write, then publishes one
+// gallery version that holds all of them. Returns a message per update, empty
+// if it was added.
+vector<string> enrollUpdates(vector<GalleryUpdate> updates) {
+    vector<string> errors(updates.size());
+    lock_guard<mutex> lock(galleryWriteLock);
+    {
+        STAT_TIMER(TIMER_GALLERY_UPDATE);
+        unordered_set<int> batchIds;
+        vector<size_t> accepted;
+        vector<const Criminal*> records;
+        for (size_t i = 0; i < updates.size(); ++i) {
+            const Criminal& c = updates[i].record;
+            if (liveGallery->records.contains(c.id) || !batchIds.insert(c.id).second) {
+                errors[i] = "ID already exists: " + to_string(c.id);
+                continue;
+            }
+            if (c.fingerprint.empty()) {
+                errors[i] = "no minutiae";
+                continue;
+            }
+            accepted.push_back(i);
+            records.push_back(&c);
+        }
+        if (accepted.empty()) return errors;
+
+        // The new version is built first and only published once the journal
+        // holds the records
+        vector<const GalleryUpdate*> batch;
+        for (size_t i : accepted) batch.push_back(&updates[i]);
+        shared_ptr<Gallery> next = nextGallery();
+        if (!applyUpdates(*next, batch)) {
+            for (size_t i : accepted) errors[i] = "ID already exists in the gallery";
+            return errors;
+        }
+        if (!appendJournal(JOURNAL_ADD, records)) {
+            for (size_t i : accepted) errors[i] = "failed to write journal; record not added";
+            return errors;
+        }
+        saveTripletBlocks(batch);
+        vector<GalleryUpdate> applied;
+        for (size_t i : accepted) applied.push_back(move(updates[i]));
+        publishGallery(next, move(applied));
+    }
+    if (autoCompact && journalSize() >= JOURNAL_COMPACT_BYTES) startCompaction(galleryRecords(liveGallery), true);
+    return errors;
+}
+
+vector<string> enrollCriminals(const vector<Criminal>& batch) {
+    vector<GalleryUpdate> updates;
+    for (const Criminal& c : batch) updates.push_back(GalleryUpdate{c, tripletKeys(c.fingerprint)});
+    return enrollUpdates(move(updates));
+}
+
+void addCriminal() {
+    printHeader("ADD NEW CRIMINAL RECORD");
+    Criminal c;
+    
+    cout << "Enter ID: ";
+    while (!(cin >> c.id) || currentGallery()->records.contains(c.id)) {
+        printError("Invalid ID or ID already exists!");
+        cin.clear();
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        cout << "Enter ID: ";
+    }
+    
+    cout << "Enter name: ";
+    cin.ignore();
+    getline(cin, c.name);
+    
+    cout << "Enter number of minutiae points: ";
+    int n;
+    while (!(cin >> n) || n <= 0) {
+        printError("Please enter a positive number!");
+        cin.clear();
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        cout << "Enter number of minutiae points: ";
+    }
+    
+    for (int i = 0; i < n; ++i) {
+        Minutiae m;
+        cout << "\nMinutiae Point #" << i + 1 << ":\n";
+        cout << "X coordinate: ";
+        cin >> m.x;
+        cout << "Y coordinate: ";
+        cin >> m.y;
+        cout << "Angle (0-359 degrees): ";
+        cin >> m.angle;
+        cout << "Type (R for Ridge ending, B for Bifurcation): ";
+        cin >> m.type;
+        cout << "Orientation (0.0-1.0): ";
+        cin >> m.orientation;
+        c.fingerprint.push_back(m);
+    }
+    
+    cout << "Number of accomplices: ";
+    int a;
+    cin >> a;
+    if (a > 0) {
+        cout << "Enter accomplice IDs (space separated): ";
+        for (int i = 0; i < a; ++i) {
+            int aid;
+            cin >> aid;
+            c.accomplices.push_back(aid);
+        }
+    }
+    
+    string error = enrollCriminals(vector<Criminal>(1, c))[0];
+    if (!error.empty()) {
+        printError("Record not added: " + error + ".");
+        return;
+    }
+    printSuccess("Criminal record added successfully!");
+    logAction("enroll", c.id);
+}
+
+void viewCriminal(int id) {
+    shared_ptr<const Gallery> g = currentGallery();
+    CriminalView c;
+    if (!g->records.find(id, c)) {
+        printError("Criminal not found!");
+        return;
+    }
+    
+    printHeader("CRIMINAL DETAILS #" + to_string(id));
+    cout << COLOR_BOLD << "Name: " << COLOR_RESET << c.name << "\n";
+    cout << COLOR_BOLD << "Fingerprint Points: " << COLOR_RESET << c.fingerprint.size() << "\n";
+    
+    if (!c.accomplices.empty()) {
+        cout << COLOR_BOLD << "Accomplices: " << COLOR_RESET;
+        for (int aid : c.accomplices) {
+            cout << aid << " ";
+        }
+        cout << "\n";
+    } else {
+        cout << COLOR_BOLD << "Accomplices: " << COLOR_RESET << "None\n";
+    }
+    
+    logAction("view", id);
+    addToSearchHistory("view", id);
+}
+
+// Plain-text report shared by the statistics menu and the exit dump
+void writeStatistics(ostream& out) {
+    shared_ptr<const Gallery> gallery = currentGallery();
+    const GalleryColumns& g = gallery->columns;
+    out << "Gallery: " << g.size() << " templates, " << g.xs.size() << " minutiae ("
+        << fixed << setprecision(1) << (g.size() ? (double)g.xs.size() / g.size() : 0.0)
+        << " per template), " << searchPool().size() << " search threads, " << pairKernelName << " kernel\n";
+    out << "Template store: " << g.bytes() / 1024 << " KB";
+    if (!g.wide.empty()) out << " (" << g.wide.size() << " templates unpacked)";
+    out << "\n";
+    out << "Record store: " << gallery->records.bytes() / 1024 << " KB\n";
+    out << "Gallery version: " << gallery->version << "\n";
+    ProbeCacheStats cache = probeCache.snapshot();
+    if (probeCacheEntries == 0) out << "Probe cache: off\n";
+    else out << "Probe cache: " << cache.hits << " hits in " << cache.lookups << " lookups (" << setprecision(1)
+        << (cache.lookups ? 100.0 * cache.hits / cache.lookups : 0.0) << "%), " << cache.entries << " of "
+        << probeCacheEntries << " entries, " << cache.evicted << " evicted, " << cache.invalidated
+        << " invalidated by enrollment\n";
+#ifdef FINGERPRINT_NO_STATS
+    out << "Instrumentation is compiled out of this build.\n";
+#else
+    StatSnapshot s = statSnapshot();
+    out << "\nCounters:\n";
+    for (int c = 0; c < COUNTER_COUNT; ++c)
+        out << "  " << left << setw(26) << COUNTER_NAMES[c] << right << s.counters[c] << "\n";
+    uint64_t candidates = s.counters[COUNTER_CANDIDATES_SCORED] + s.counters[COUNTER_CANDIDATES_PRUNED];
+    if (candidates)
+        out << "  " << left << setw(26) << "Scoring per candidate" << right << setprecision(1)
+            << (double)s.timerNanos[TIMER_SCORING] / candidates << " ns\n";
+
+    out << "\nTimers:              calls      total ms      avg us\n";
+    for (int t = 0; t < TIMER_COUNT; ++t)
+        out << "  " << left << setw(18) << TIMER_NAMES[t] << right << setw(8) << s.timerCalls[t]
+            << setw(14) << setprecision(2) << s.timerNanos[t] / 1e6
+            << setw(12) << (s.timerCalls[t] ? s.timerNanos[t] / 1e3 / s.timerCalls[t] : 0.0) << "\n";
+
+    out << "\nSearch latency:      queries    p50 <= ms    p99 <= ms      max ms\n";
+    for (int m = 0; m < STAT_METHODS; ++m) {
+        uint64_t queries = 0;
+        for (int b = 0; b < LATENCY_BUCKETS; ++b) queries += s.latency[m][b];
+        out << "  " << left << setw(18) << methodName(m + 1) << right << setw(8) << queries
+            << setw(13) << setprecision(3) << latencyQuantile(s.latency[m], 0.50)
+            << setw(13) << latencyQuantile(s.latency[m], 0.99)
+            << setw(12) << s.latencyMax[m] / 1000.0 << "\n";
+    }
+
+    if (!s.slowest.empty()) {
+        out << "\nSlowest queries:\n";
+        for (const auto& q : s.slowest) {
+            char when[32];
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&q.when));
+            out << "  " << setw(10) << setprecision(3) << q.ms << " ms  " << left << setw(8)
+                << methodName(q.method) << right << " probe " << q.probeMinutiae << " minutiae, gallery "
+                << q.gallerySize << ", at " << when << "\n";
+        }
+    }
+#endif
+}
+
+void viewStatistics() {
+    printHeader("SYSTEM STATISTICS");
+    writeStatistics(cout);
+}
+
+// Appends the session's statistics to statsFile
+void dumpStatistics() {
+    ofstream fout(statsFile, ios::app);
+    time_t now = time(0);
+    fout << "=== " << ctime(&now);
+    writeStatistics(fout);
+    fout << "\n";
+}
+
+void matchFingerprint() {
+    printHeader("FINGERPRINT MATCHING SYSTEM");
+    cout << COLOR_BLUE << "=== (Ridge & Bifurcation Analysis) ===\n" << COLOR_RESET;
+    
+    // Collect fingerprint sample
+    cout << "\nEnter number of minutiae points: ";
+    int n;
+    while (!(cin >> n) || n <= 0) {
+        printError("Please enter a positive number!");
+        cin.clear();
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        cout << "Enter number of minutiae points: ";
+    }
+
+    vector<Minutiae> testPrint(n);
+    for (int i = 0; i < n; ++i) {
+        cout << "\nPoint " << i + 1 << " details:\n";
+        cout << "Type (R for Ridge, B for Bifurcation): ";
+        cin >> testPrint[i].type;
+        cout << "Coordinates (x y): ";
+        cin >> testPrint[i].x >> testPrint[i].y;
+        cout << "Angle (0-359 degrees): ";
+        cin >> testPrint[i].angle;
+        if (testPrint[i].type == 'R') {
+            cout << "Ridge count from reference: ";
+            cin >> testPrint[i].orientation;
+        }
+    }
+
+    // Add method selection back in
+    cout << "\n" << COLOR_BOLD << "Select matching method:" << COLOR_RESET << "\n";
+    cout << "1. Graph-based matching (precise point comparison)\n";
+    cout << "2. Zonal-based matching (regional characteristics)\n";
+    cout << "3. Cascade (zonal shortlist, graph rescoring)\n";
+    cout << "4. Indexed (triplet voting, graph rescoring)\n";
+    cout << "Your choice (1-4): ";
+    
+    int method;
+    while (!(cin >> method) || method < METHOD_GRAPH || method > METHOD_INDEXED) {
+        printError("Please enter a number between 1 and 4!");
+        cin.clear();
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        cout << "Your choice (1-4): ";
+    }
+
+    cout << "Number of candidates to list (1-" << MAX_CANDIDATES << "): ";
+    int candidates;
+    while (!(cin >> candidates) || candidates < 1 || candidates > (int)MAX_CANDIDATES) {
+        printError("Please enter a number between 1 and " + to_string(MAX_CANDIDATES) + "!");
+        cin.clear();
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        cout << "Number of candidates to list (1-" << MAX_CANDIDATES << "): ";
+    }
+
+    // Perform matching
+    printInfo("Analyzing fingerprint...");
+    
+    shared_ptr<const Gallery> g = currentGallery();
+    bool cached;
+    SearchResult result = cachedSearch(*g, testPrint, method, candidates, &cached);
+    int bestID = result.hits.empty() ? -1 : result.hits[0].id;
+
+    // Display results
+    printHeader("FINGERPRINT MATCH RESULT");
+    
+    if (bestID == -1) {
+        printError("No matching fingerprint found in database!");
+    } else {
+        const SearchHit& best = result.hits[0];
+        double confidence = 100 * (1.0 - best.score);
+        
+        // Main match result
+        cout << "+---------------------------------------+\n";
+        cout << "| " << COLOR_BOLD << "Match: Criminal #" << bestID << " (" << criminalName(g->records, bestID) << ")" << COLOR_RESET << " |\n";
+        cout << "| " << COLOR_BOLD << "Confidence: " << fixed << setprecision(2) 
+             << ((confidence > 99.995) ? 100.00 : confidence) << "%" << COLOR_RESET << " |\n";
+        cout << "+---------------------------------------+\n\n";
+
+        // Ranked candidate list
+        printHeader("CANDIDATE LIST");
+        for (size_t rank = 0; rank < result.hits.size(); ++rank) {
+            const SearchHit& hit = result.hits[rank];
+            double c = 100 * (1.0 - hit.score);
+            cout << setw(3) << rank + 1 << ". [" << hit.id << "] " << criminalName(g->records, hit.id)
+                 << " - " << fixed << setprecision(2) << ((c > 99.995) ? 100.00 : c) << "%\n";
+        }
+        cout << COLOR_BLUE << "Scored " << result.scored << " candidates, pruned "
+             << result.pruned << " early" << (cached ? " (cached result)" : "") << "\n";
+        if (method == METHOD_CASCADE) {
+            uint64_t queries = cascadeStats.queries, audited = cascadeStats.audited;
+            cout << "Cascade shortlist: " << result.shortlisted << " of " << g->columns.size()
+                 << " (average " << (queries ? cascadeStats.shortlisted / queries : 0) << ")\n";
+            cout << "Shortlist audits: " << audited << ", missed best graph match: " << cascadeStats.missed << "\n";
+        } else if (method == METHOD_INDEXED) {
+            cout << "Index candidates: " << result.shortlisted << " of " << g->columns.size() << "\n";
+        }
+        cout << COLOR_RESET << "\n";
+
+        // Detailed analysis
+        printHeader("DETAILED ANALYSIS");
+        cout << "+---------------------------------------+\n";
+        cout << "| " << COLOR_BOLD << "Ridge endings matched: " << best.ridgeMatches << COLOR_RESET << " |\n";
+        cout << "| " << COLOR_BOLD << "Bifurcations matched: " << best.bifurcationMatches << COLOR_RESET << " |\n";
+        cout << "| " << COLOR_BOLD << "Total minutiae points: " << testPrint.size() << COLOR_RESET << " |\n";
+        cout << "+---------------------------------------+\n";
+        
+        // Show ridge counts if available
+        bool hasRidgeCounts = false;
+        for (auto& m : testPrint) {
+            if (m.type == 'R' && m.orientation != 0) {
+                hasRidgeCounts = true;
+                break;
+            }
+        }
+        
+        if (hasRidgeCounts) {
+            cout << "\n" << COLOR_BLUE << "Ridge Counts from Reference:\n";
+            for (int i = 0; i < testPrint.size(); i++) {
+                if (testPrint[i].type == 'R') {
+                    cout << "- Point " << i+1 << ": " << testPrint[i].orientation << "\n";
+                }
+            }
+            cout << COLOR_RESET;
+        }
+
+        // Show network option
+        cout << "\n" << COLOR_BOLD << "View accomplice network for this criminal? (y/n): " << COLOR_RESET;
+        char choice;
+        cin >> choice;
+        if (choice == 'y' || choice == 'Y') {
+            showAccompliceNetwork(g->records, g->network, bestID);
+        }
+        
+        logAction("match", bestID);
+        addToSearchHistory("match", bestID);
+    }
+}
+// ================== BATCH MODE ==================
+string jsonEscape(string_view text) {
+    string out;
+    for (unsigned char ch : text) {
+        switch (ch) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (ch < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", ch);
+                    out += buf;
+                } else {
+                    out += ch;
+                }
+        }
+    }
+    return out;
+}
+
+// Score and confidence fields of a candidate. Scores are rounded to 6 places
+// for people; `exact` writes them in full for a coordinator that re-ranks them.
+string scoreJson(double score, bool exact = false) {
+    ostringstream out;
+    out << "\"score\":";
+    if (exact) out << setprecision(17) << score;
+    else out << fixed << setprecision(6) << score;
+    out << ",\"confidence\":" << fixed << setprecision(2) << min(100.0, 100 * (1.0 - score));
+    return out.str();
+}
+
+// "candidates":[...] fragment shared by every machine-readable result
+string candidatesJson(const RecordStore& db, const vector<SearchHit>& hits, bool exact = false) {
+    ostringstream out;
+    out << "\"candidates\":[";
+    for (size_t rank = 0; rank < hits.size(); ++rank) {
+        const SearchHit& hit = hits[rank];
+        out << (rank ? "," : "") << "{\"rank\":" << rank + 1 << ",\"id\":" << hit.id
+            << ",\"name\":\"" << jsonEscape(criminalName(db, hit.id)) << "\"," << scoreJson(hit.score, exact) << "}";
+    }
+    out << "]";
+    return out.str();
+}
+
+// fingerprint --batch <probes|-> [--method graph|zonal|cascade|indexed] [--top-k n] --user <name>
+// Probes use the database record format (label|name|x|y|angle|type|orientation|...);
+// the password is read from FP_PASSWORD. One JSON line is written per probe.
+int runBatch(const vector<string>& args) {
+    string input = "-", user;
+    int method = METHOD_GRAPH;
+    size_t k = 10;
+    statusOut = &cerr;
+
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "--method" && i + 1 < args.size()) method = methodFromName(args[++i]);
+        else if (args[i] == "--top-k" && i + 1 < args.size()) k = max(1, atoi(args[++i].c_str()));
+        else if (args[i] == "--user" && i + 1 < args.size()) user = args[++i];
+        else input = args[i];
+    }
+    if (method < 0) {
+        printError("Unknown method; use graph, zonal, cascade or indexed");
+        return 1;
+    }
+    const char* password = getenv("FP_PASSWORD");
+    sessionUser = user;
+    if (user.empty() || !password || !checkCredentials(user, password)) {
+        printError("Batch mode needs --user and a valid FP_PASSWORD");
+        logAction("login-failed", NO_CRIMINAL, "batch");
+        return 1;
+    }
+
+    istream* in = &cin;
+    ifstream file;
+    if (input != "-") {
+        file.open(input);
+        if (!file) {
+            printError("Cannot open probe file: " + input);
+            return 1;
+        }
+        in = &file;
+    }
+
+    loadGallery(false, method == METHOD_INDEXED);
+    shared_ptr<const Gallery> g = currentGallery();
+    logAction("batch-start", NO_CRIMINAL, input);
+
+    string line;
+    size_t processed = 0;
+    while (getline(*in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        stringstream ss(line);
+        string label;
+        getline(ss, label, '|');
+        Criminal probe;
+        parseRecordFields(ss, probe);
+
+        ostringstream out;
+        out << "{\"probe\":\"" << jsonEscape(label) << "\",\"method\":\"" << methodName(method) << "\"";
+        if (probe.fingerprint.empty()) {
+            out << ",\"error\":\"no minutiae\"}";
+        } else {
+            auto start = chrono::steady_clock::now();
+            bool cached;
+            SearchResult result = cachedSearch(*g, probe.fingerprint, method, k, &cached);
+            double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            out << "," << candidatesJson(g->records, result.hits)
+                << ",\"scored\":" << result.scored << ",\"pruned\":" << result.pruned
+                << ",\"cached\":" << (cached ? "true" : "false") << ",\"elapsed_ms\":" << fixed << setprecision(3) << elapsed << "}";
+            if (!result.hits.empty())
+                addToSearchHistory("match", result.hits[0].id, "batch probe " + label);
+        }
+        cout << out.str() << "\n" << flush;
+        processed++;
+    }
+
+    logAction("batch-end", NO_CRIMINAL, to_string(processed) + " probes");
+    dumpStatistics();
+    return 0;
+}
+
+// ================== DEDUPLICATION ==================
+// fingerprint --dedup --user <name> [--threshold t] [--tile n] [--out file]
+//                     [--checkpoint file] [--checkpoint-seconds s]
+// Compares every pair of gallery templates to find one person enrolled under
+// several IDs. Template i is scored as a probe against every later template j
+// with the graph matcher, abandoning the pair as soon as it cannot reach the
+// threshold. The (i, j) triangle is cut into tiles of `tile` x `tile`
+// templates, small enough for both blocks to stay in cache. Tiles are taken
+// in row-major order, a round of them at a time across the search pool. After
+// a round the pairs found so far and the next tile are written to the
+// checkpoint, so an interrupted run picks up where it stopped when the same
+// command is run again. Pairs at or above the threshold are grouped into
+// clusters, written as one JSON line each.
+const size_t DEDUP_TILE = 128;          // templates per tile side
+const size_t DEDUP_ROUND_TILES = 8;     // tiles per worker thread between checkpoint checks
+
+volatile sig_atomic_t dedupSignal = 0;
+
+void onDedupSignal(int) { dedupSignal = 1; }
+
+struct DedupPair {
+    uint32_t a, b;   // positions in the gallery's columns, a < b
+    double score;    // graph score, lower is better
+};
+
+struct DedupCheckpoint {
+    size_t templates = 0;
+    uint64_t gallery = 0;   // galleryDigest() of the gallery it was taken on
+    double threshold = 0;
+    size_t tile = 0;
+    size_t next = 0;        // first tile not yet done
+    vector<DedupPair> pairs;
+};
+
+// Identifies the gallery a checkpoint belongs to: IDs and template contents
+uint64_t galleryDigest(const Gallery& g) {
+    uint64_t h = 1469598103934665603ull;
+    for (size_t i = 0; i < g.columns.size(); ++i) {
+        h = (h ^ (uint32_t)g.columns.ids[i]) * 1099511628211ull;
+        h = (h ^ templateHash(g.records.view(g.records.slotOf(g.columns.ids[i])).fingerprint)) * 1099511628211ull;
+    }
+    return h;
+}
+
+bool saveDedupCheckpoint(const string& path, const DedupCheckpoint& c) {
+    string tmpPath = path + ".tmp";
+    ofstream fout(tmpPath, ios::trunc);
+    fout << "fingerprint-dedup 1\n"
+         << c.templates << " " << c.gallery << " " << setprecision(17) << c.threshold << " " << c.tile
+         << " " << c.next << " " << c.pairs.size() << "\n";
+    for (const auto& p : c.pairs) fout << p.a << " " << p.b << " " << p.score << "\n";
+    fout.close();
+    if (!fout) {
+        remove(tmpPath.c_str());
+        return false;
+    }
+#ifdef _WIN32
+    remove(path.c_str());
+#endif
+    return rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+bool loadDedupCheckpoint(const string& path, DedupCheckpoint& c) {
+    ifstream fin(path);
+    string magic;
+    int version;
+    size_t count;
+    if (!(fin >> magic >> version) || magic != "fingerprint-dedup" || version != 1) return false;
+    if (!(fin >> c.templates >> c.gallery >> c.threshold >> c.tile >> c.next >> count)) return false;
+    c.pairs.resize(count);
+    for (auto& p : c.pairs)
+        if (!(fin >> p.a >> p.b >> p.score)) return false;
+    return true;
+}
+
+// Tile `t` of the row-major upper triangle of a blocks x blocks grid
+pair<size_t, size_t> dedupTileAt(size_t t, size_t blocks) {
+    // Row r starts at tile r * blocks - r * (r - 1) / 2
+    auto start = [&](size_t r) { return r * blocks - r * (r - 1) / 2; };
+    double b = blocks + 0.5;
+    size_t row = (size_t)max(0.0, b - sqrt(max(0.0, b * b - 2.0 * t)));
+    while (row > 0 && start(row) > t) row--;
+    while (row + 1 < blocks && start(row + 1) <= t) row++;
+    return {row, row + (t - start(row))};
+}
+
+// Scores the pairs of one tile; probes[i] is the template at column position i
+void dedupTile(const GalleryColumns& g, const vector<MinutiaeSpan>& probes, size_t t, size_t blocks,
+               size_t tile, double bound, vector<DedupPair>& out) {
+    pair<size_t, size_t> at = dedupTileAt(t, blocks);
+    size_t rowEnd = min(g.size(), (at.first + 1) * tile);
+    size_t colEnd = min(g.size(), (at.second + 1) * tile);
+    SearchHit hit;
+    for (size_t i = at.first * tile; i < rowEnd; ++i) {
+        if (probes[i].size() == 0) continue;
+        for (size_t j = max(i + 1, at.second * tile); j < colEnd; ++j) {
+            // Not pruned only means the scan finished; the score can still miss the bound
+            if (g.length(j) == 0 || !scoreGraphCandidate(probes[i], g, j, bound, hit) || hit.score > bound) continue;
+            out.push_back(DedupPair{(uint32_t)i, (uint32_t)j, hit.score});
+        }
+    }
+}
+
+// Suspected duplicates: connected groups of the pairs found
+string dedupClustersJson(const Gallery& g, const vector<MinutiaeSpan>& probes, const vector<DedupPair>& pairs,
+                         size_t& clusters) {
+    // Union by size with path halving: long chains of pairs stay shallow
+    unordered_map<uint32_t, uint32_t> parent, size;
+    auto find = [&](uint32_t v) {
+        if (parent.emplace(v, v).second) size[v] = 1;
+        while (parent[v] != v) {
+            parent[v] = parent[parent[v]];
+            v = parent[v];
+        }
+        return v;
+    };
+    for (const auto& p : pairs) {
+        uint32_t a = find(p.a), b = find(p.b);
+        if (a == b) continue;
+        if (size[a] < size[b]) swap(a, b);
+        parent[b] = a;
+        size[a] += size[b];
+    }
+
+    map<uint32_t, vector<uint32_t>> members;
+    for (const auto& entry : parent) members[find(entry.first)].push_back(entry.first);
+    map<uint32_t, vector<const DedupPair*>> links;
+    for (const auto& p : pairs) links[find(p.a)].push_back(&p);
+
+    vector<vector<uint32_t>*> order;
+    for (auto& entry : members) {
+        sort(entry.second.begin(), entry.second.end(),
+             [&](uint32_t x, uint32_t y) { return g.columns.ids[x] < g.columns.ids[y]; });
+        order.push_back(&entry.second);
+    }
+    sort(order.begin(), order.end(), [&](const vector<uint32_t>* x, const vector<uint32_t>* y) {
+        if (x->size() != y->size()) return x->size() > y->size();
+        return g.columns.ids[x->front()] < g.columns.ids[y->front()];
+    });
+
+    ostringstream out;
+    for (size_t c = 0; c < order.size(); ++c) {
+        const vector<uint32_t>& group = *order[c];
+        out << "{\"cluster\":" << c + 1 << ",\"size\":" << group.size() << ",\"members\":[";
+        for (size_t m = 0; m < group.size(); ++m) {
+            int id = g.columns.ids[group[m]];
+            out << (m ? "," : "") << "{\"id\":" << id << ",\"name\":\"" << jsonEscape(criminalName(g.records, id))
+                << "\"}";
+        }
+        out << "],\"pairs\":[";
+        vector<const DedupPair*>& edges = links[find(group.front())];
+        sort(edges.begin(), edges.end(), [&](const DedupPair* x, const DedupPair* y) {
+            return make_pair(g.columns.ids[x->a], g.columns.ids[x->b]) < make_pair(g.columns.ids[y->a], g.columns.ids[y->b]);
+        });
+        for (size_t e = 0; e < edges.size(); ++e) {
+            const DedupPair& p = *edges[e];
+            double zonal = compareZonalMatching(probes[p.a], probes[p.b]);
+            out << (e ? "," : "") << "{\"a\":" << g.columns.ids[p.a] << ",\"b\":" << g.columns.ids[p.b]
+                << ",\"graph\":" << fixed << setprecision(6) << p.score << ",\"zonal\":" << zonal
+                << ",\"confidence\":" << setprecision(2) << min(100.0, 100 * (1.0 - p.score)) << "}";
+        }
+        out << "]}\n";
+    }
+    clusters = order.size();
+    return out.str();
+}
+
+int runDedup(const vector<string>& args) {
+    string user, outPath = "-", checkpointPath = dedupCheckpointFile;
+    double threshold = 0.8;
+    size_t tile = DEDUP_TILE;
+    int checkpointSeconds = 60;
+    statusOut = &cerr;
+
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "--user" && i + 1 < args.size()) user = args[++i];
+        else if (args[i] == "--threshold" && i + 1 < args.size()) threshold = atof(args[++i].c_str());
+        else if (args[i] == "--tile" && i + 1 < args.size()) tile = max(1, atoi(args[++i].c_str()));
+        else if (args[i] == "--out" && i + 1 < args.size()) outPath = args[++i];
+        else if (args[i] == "--checkpoint" && i + 1 < args.size()) checkpointPath = args[++i];
+        else if (args[i] == "--checkpoint-seconds" && i + 1 < args.size())
+            checkpointSeconds = max(0, atoi(args[++i].c_str()));
+    }
+    if (!(threshold > 0 && threshold <= 1)) {
+        printError("--threshold must be above 0 and at most 1");
+        return 1;
+    }
+    const char* password = getenv("FP_PASSWORD");
+    sessionUser = user;
+    if (user.empty() || !password || !checkCredentials(user, password)) {
+        printError("Dedup mode needs --user and a valid FP_PASSWORD");
+        logAction("login-failed", NO_CRIMINAL, "dedup");
+        return 1;
+    }
+
+    loadGallery(false, false);
+    shared_ptr<const Gallery> gallery = currentGallery();
+    const Gallery& g = *gallery;
+    vector<MinutiaeSpan> probes(g.columns.size());
+    for (size_t i = 0; i < probes.size(); ++i)
+        probes[i] = g.records.view(g.records.slotOf(g.columns.ids[i])).fingerprint;
+
+    size_t blocks = (g.columns.size() + tile - 1) / tile;
+    DedupCheckpoint state;
+    state.templates = g.columns.size();
+    state.gallery = galleryDigest(g);
+    state.threshold = threshold;
+    state.tile = tile;
+
+    DedupCheckpoint saved;
+    if (loadDedupCheckpoint(checkpointPath, saved)) {
+        if (saved.templates == state.templates && saved.gallery == state.gallery &&
+            saved.threshold == threshold && saved.tile == tile) {
+            state = move(saved);
+            printInfo("Resuming from " + checkpointPath + ": " + to_string(state.next) + " of " +
+                      to_string(blocks * (blocks + 1) / 2) + " tiles done");
+        } else {
+            printWarning("Ignoring " + checkpointPath + ": it belongs to another gallery or settings");
+        }
+    }
+
+    logAction("dedup-start");
+    // Plain signal(): the tile loop only polls the flag, and it builds on Windows
+    signal(SIGINT, onDedupSignal);
+    signal(SIGTERM, onDedupSignal);
+
+    WorkerPool& pool = searchPool();
+    size_t tiles = blocks * (blocks + 1) / 2;
+    size_t round = max<size_t>(1, pool.size() * DEDUP_ROUND_TILES);
+    double bound = 1.0 - threshold;
+    auto lastCheckpoint = chrono::steady_clock::now();
+    vector<vector<DedupPair>> found(pool.size());
+    while (state.next < tiles && !dedupSignal) {
+        size_t first = state.next, count = min(round, tiles - first);
+        pool.parallelFor(count, 1, [&](size_t begin, size_t end, unsigned slot) {
+            for (size_t t = begin; t < end; ++t) dedupTile(g.columns, probes, first + t, blocks, tile, bound, found[slot]);
+        });
+        for (auto& part : found) {
+            state.pairs.insert(state.pairs.end(), part.begin(), part.end());
+            part.clear();
+        }
+        state.next = first + count;
+
+        auto now = chrono::steady_clock::now();
+        if (state.next < tiles && now - lastCheckpoint >= chrono::seconds(checkpointSeconds)) {
+            if (!saveDedupCheckpoint(checkpointPath, state)) printWarning("Failed to write " + checkpointPath);
+            printInfo("Dedup: " + to_string(state.next) + " of " + to_string(tiles) + " tiles, " +
+                      to_string(state.pairs.size()) + " pairs");
+            lastCheckpoint = now;
+        }
+    }
+    if (state.next < tiles) {
+        bool written = saveDedupCheckpoint(checkpointPath, state);
+        printWarning("Dedup interrupted at tile " + to_string(state.next) + " of " + to_string(tiles) +
+                     (written ? "; run the same command again to resume" : "; failed to write " + checkpointPath));
+        logAction("dedup-stop", NO_CRIMINAL, "tile " + to_string(state.next));
+        return 1;
+    }
+
+    size_t clusters;
+    string report = dedupClustersJson(g, probes, state.pairs, clusters);
+    if (outPath == "-") {
+        cout << report << flush;
+    } else {
+        ofstream fout(outPath, ios::trunc);
+        fout << report;
+        fout.close();
+        if (!fout) {
+            printError("Failed to write " + outPath + "; the checkpoint is kept");
+            saveDedupCheckpoint(checkpointPath, state);
+            return 1;
+        }
+    }
+    remove(checkpointPath.c_str());
+    printSuccess(to_string(clusters) + " clusters of suspected duplicates (" + to_string(state.pairs.size()) +
+                 " pairs) among " + to_string(g.columns.size()) + " templates");
+    logAction("dedup-end", NO_CRIMINAL, to_string(clusters) + " clusters");
+    return 0;
+}
+
+// ================== BULK IMPORT ==================
+// fingerprint --import <file|-> --user <name> [--batch-size n] [--rejects file]
+// Enrolls a large transfer of database-format records as a pipeline of four
+// threads joined by bounded queues, so reading, checking, feature extraction
+// and writing overlap and memory stays at a few batches:
+//   parse     lines -> records, IDs and fields checked for syntax
+//   validate  coordinate and angle ranges, minutia types, repeated IDs
+//   features  triplet keys, across the search pool
+//   persist   one journal write, one triplet index append and one gallery
+//             version (graph included) per batch, via enrollUpdates()
+// Accomplice IDs that match no record, in the gallery or anywhere in the
+// input, are kept (like any unknown accomplice) and reported at the end.
+const size_t IMPORT_BATCH = 4096;         // records per batch
+const size_t IMPORT_QUEUE_DEPTH = 4;      // batches waiting between two stages
+
+struct ImportBatch {
+    vector<Criminal> records;
+    vector<size_t> lines;          // input line of each record
+    vector<string> errors;         // per record; empty while it is accepted
+    vector<vector<uint64_t>> tripletKeys;
+};
+
+// Bounded hand-off between two pipeline stages. push() blocks while the queue
+// is full; pop() returns false once it is closed and drained.
+template <typename T>
+class StageQueue {
+public:
+    explicit StageQueue(size_t capacity) : capacity(capacity) {}
+
+    void push(T item) {
+        unique_lock<mutex> lock(queueLock);
+        notFull.wait(lock, [&] { return items.size() < capacity; });
+        items.push_back(move(item));
+        notEmpty.notify_one();
+    }
+
+    bool pop(T& item) {
+        unique_lock<mutex> lock(queueLock);
+        notEmpty.wait(lock, [&] { return !items.empty() || closed; });
+        if (items.empty()) return false;
+        item = move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        lock_guard<mutex> lock(queueLock);
+        closed = true;
+        notEmpty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    mutex queueLock;
+    condition_variable notFull, notEmpty;
+    deque<T> items;
+    bool closed = false;
+};
+
+void importParse(istream& in, size_t batchSize, StageQueue<ImportBatch>& out) {
+    ImportBatch batch;
+    string line;
+    size_t lineNo = 0;
+    while (getline(in, line)) {
+        lineNo++;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        FieldCursor f = {line.data(), line.data() + line.size()};
+        const char *first = f.end, *last = f.end;
+        Criminal c;
+        bool malformed = false;
+        f.next(first, last);
+        string error;
+        if (!parseIntField(first, last, c.id)) error = "bad ID";
+        else parseRecordTail(f, c, malformed);
+        if (error.empty() && malformed) error = "malformed minutia or accomplice field";
+        batch.records.push_back(move(c));
+        batch.lines.push_back(lineNo);
+        batch.errors.push_back(move(error));
+        if (batch.records.size() == batchSize) {
+            out.push(move(batch));
+            batch = ImportBatch();
+        }
+    }
+    if (!batch.records.empty()) out.push(move(batch));
+    out.close();
+}
+
+string validateMinutiae(const vector<Minutiae>& fp) {
+    if (fp.empty()) return "no minutiae";
+    for (size_t i = 0; i < fp.size(); ++i) {
+        const Minutiae& m = fp[i];
+        string point = "minutia " + to_string(i + 1) + ": ";
+        // Columns pack points relative to the template's bounding box (packable(),
+        // PACKED_SPAN) and score the rest exactly from `wide`, so coordinates
+        // need no upper limit. Angles of 0-359 also fit the packed angle field.
+        if (m.x < 0 || m.y < 0) return point + "negative coordinate";
+        if (m.angle < 0 || m.angle > 359) return point + "angle outside 0-359";
+        if (m.type != 'R' && m.type != 'B') return point + "type must be R or B";
+        if (!isfinite(m.orientation)) return point + "bad orientation";
+    }
+    return "";
+}
+
+// `referenced` collects accomplice IDs not in the gallery, `seen` every ID
+// accepted so far; dangling IDs are the difference once the input ends
+void importValidate(StageQueue<ImportBatch>& in, StageQueue<ImportBatch>& out,
+                    unordered_set<int>& seen, unordered_set<int>& referenced) {
+    shared_ptr<const Gallery> g = currentGallery();
+    ImportBatch batch;
+    while (in.pop(batch)) {
+        for (size_t i = 0; i < batch.records.size(); ++i) {
+            const Criminal& c = batch.records[i];
+            string& error = batch.errors[i];
+            if (error.empty()) error = validateMinutiae(c.fingerprint);
+            if (error.empty() && g->records.contains(c.id)) error = "ID already exists: " + to_string(c.id);
+            if (error.empty() && !seen.insert(c.id).second) error = "ID repeated in the input: " + to_string(c.id);
+            if (!error.empty()) continue;
+            for (int accompliceId : c.accomplices)
+                if (!g->records.contains(accompliceId)) referenced.insert(accompliceId);
+        }
+        out.push(move(batch));
+    }
+    out.close();
+}
+
+void importFeatures(StageQueue<ImportBatch>& in, StageQueue<ImportBatch>& out) {
+    ImportBatch batch;
+    while (in.pop(batch)) {
+        batch.tripletKeys.assign(batch.records.size(), {});
+        searchPool().parallelFor(batch.records.size(), 64, [&](size_t begin, size_t end, unsigned) {
+            for (size_t i = begin; i < end; ++i)
+                if (batch.errors[i].empty()) batch.tripletKeys[i] = tripletKeys(batch.records[i].fingerprint);
+        });
+        out.push(move(batch));
+    }
+    out.close();
+}
+
+struct ImportTotals {
+    size_t records = 0;
+    size_t imported = 0;
+    size_t batches = 0;
+    vector<string> rejected;       // "line N: reason"
+};
+
+void importPersist(StageQueue<ImportBatch>& in, ImportTotals& totals) {
+    ImportBatch batch;
+    while (in.pop(batch)) {
+        vector<GalleryUpdate> updates;
+        vector<size_t> owners;
+        for (size_t i = 0; i < batch.records.size(); ++i) {
+            if (!batch.errors[i].empty()) continue;
+            updates.push_back(GalleryUpdate{move(batch.records[i]), move(batch.tripletKeys[i])});
+            owners.push_back(i);
+        }
+        vector<string> errors = enrollUpdates(move(updates));
+        for (size_t j = 0; j < owners.size(); ++j) batch.errors[owners[j]] = move(errors[j]);
+        for (size_t i = 0; i < batch.records.size(); ++i) {
+            if (batch.errors[i].empty()) totals.imported++;
+            else totals.rejected.push_back("line " + to_string(batch.lines[i]) + ": " + batch.errors[i]);
+        }
+        totals.records += batch.records.size();
+        totals.batches++;
+    }
+}
+
+int runImport(const vector<string>& args) {
+    string input, user, rejectsPath;
+    size_t batchSize = IMPORT_BATCH;
+    statusOut = &cerr;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "--user" && i + 1 < args.size()) user = args[++i];
+        else if (args[i] == "--batch-size" && i + 1 < args.size()) batchSize = max(1, atoi(args[++i].c_str()));
+        else if (args[i] == "--rejects" && i + 1 < args.size()) rejectsPath = args[++i];
+        else input = args[i];
+    }
+    if (input.empty()) {
+        printError("Usage: --import <file|-> --user <name>");
+        return 1;
+    }
+    const char* password = getenv("FP_PASSWORD");
+    sessionUser = user;
+    if (user.empty() || !password || !checkCredentials(user, password)) {
+        printError("Import mode needs --user and a valid FP_PASSWORD");
+        logAction("login-failed", NO_CRIMINAL, "import");
+        return 1;
+    }
+    istream* in = &cin;
+    ifstream file;
+    if (input != "-") {
+        file.open(input);
+        if (!file) {
+            printError("Cannot open import file: " + input);
+            return 1;
+        }
+        in = &file;
+    }
+
+    loadGallery(false, false);
+    logAction("import-start", NO_CRIMINAL, input);
+    // Every background compaction would rewrite the whole database; fold the
+    // journal once at the end instead
+    autoCompact = false;
+    auto start = chrono::steady_clock::now();
+
+    StageQueue<ImportBatch> parsed(IMPORT_QUEUE_DEPTH), validated(IMPORT_QUEUE_DEPTH), featured(IMPORT_QUEUE_DEPTH);
+    unordered_set<int> seen, referenced;
+    ImportTotals totals;
+    thread parser(importParse, ref(*in), batchSize, ref(parsed));
+    thread validator(importValidate, ref(parsed), ref(validated), ref(seen), ref(referenced));
+    thread extractor(importFeatures, ref(validated), ref(featured));
+    importPersist(featured, totals);
+    parser.join();
+    validator.join();
+    extractor.join();
+    if (journalSize() >= JOURNAL_COMPACT_BYTES) saveCriminalDB(galleryRecords(currentGallery()));
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    vector<int> dangling;
+    for (int id : referenced)
+        if (!seen.count(id)) dangling.push_back(id);
+    sort(dangling.begin(), dangling.end());
+
+    for (size_t i = 0; i < totals.rejected.size() && i < REPORTED_LINES; ++i) printWarning("Rejected " + totals.rejected[i]);
+    if (!rejectsPath.empty() && !totals.rejected.empty()) {
+        ofstream rejects(rejectsPath, ios::trunc);
+        for (const string& r : totals.rejected) rejects << r << "\n";
+        if (!rejects) printWarning("Failed to write " + rejectsPath);
+    }
+    if (!dangling.empty()) {
+        string sample;
+        for (size_t i = 0; i < dangling.size() && i < REPORTED_LINES; ++i) sample += " " + to_string(dangling[i]);
+        printWarning(to_string(dangling.size()) + " accomplice IDs match no record:" + sample +
+                     (dangling.size() > REPORTED_LINES ? " ..." : ""));
+    }
+    ostringstream summary;
+    summary << "Imported " << totals.imported << " of " << totals.records << " records in " << totals.batches
+            << " batches (" << totals.rejected.size() << " rejected), " << fixed << setprecision(1) << seconds
+            << " s, " << setprecision(0) << (seconds > 0 ? totals.imported / seconds : 0.0) << " records/s";
+    printSuccess(summary.str());
+    logAction("import-end", NO_CRIMINAL, to_string(totals.imported) + " of " + to_string(totals.records) + " records");
+    dumpStatistics();
+    closeJournal();
+    return totals.rejected.empty() ? 0 : 2;
+}
+
+// ================== MATCH DAEMON ==================
+// fingerprint --serve [socket] --user <name>
+// Keeps the gallery loaded and answers requests over a Unix domain socket.
+// Every message in either direction is a frame: a 4-byte big-endian length
+// followed by that many bytes of payload. Requests are text:
+//   match <graph|zonal|cascade|indexed> <k> <label|name|x|y|angle|type|orientation|...>
+//   shard-match ...   the same, with scores unrounded for the coordinator
+//   enroll <id|name|x|y|angle|type|orientation|...|AC|accomplice|...>
+//   view <id>
+//   network <id>
+//   ring <id>
+//   path <id> <id>
+//   within <id> <hops>
+// and every reply is one JSON object carrying an "ok" field.
+const uint32_t MAX_FRAME_BYTES = 1 << 20;
+const size_t MAX_RING_MEMBERS = 10000;   // member IDs listed in a ring reply
+
+string errorJson(const string& message) {
+    return "{\"ok\":false,\"error\":\"" + jsonEscape(message) + "\"}";
+}
+
+string criminalJson(const CriminalView& c) {
+    ostringstream out;
+    out << "{\"ok\":true,\"id\":" << c.id << ",\"name\":\"" << jsonEscape(c.name) << "\""
+        << ",\"minutiae\":" << c.fingerprint.size() << ",\"accomplices\":[";
+    for (size_t i = 0; i < c.accomplices.size(); ++i) out << (i ? "," : "") << c.accomplices[i];
+    out << "]}";
+    return out.str();
+}
+
+string networkJson(const Gallery& gallery, int id) {
+    const AccompliceGraph& g = gallery.network;
+    vector<uint32_t> order;
+    vector<int> degree;
+    walkNetwork(g, g.vertexOf(id), order, degree);
+
+    ostringstream out;
+    out << "{\"ok\":true,\"id\":" << id << ",\"members\":[";
+    for (size_t i = 0; i < order.size(); ++i) {
+        int member = g.ids[order[i]];
+        out << (i ? "," : "") << "{\"id\":" << member << ",\"name\":\"" << jsonEscape(criminalName(gallery.records, member))
+            << "\",\"degree\":" << degree[order[i]] << "}";
+    }
+    out << "],\"max_degree\":" << degree[order.back()] << "}";
+    return out.str();
+}
+
+string matchJson(const Gallery& g, const string& label, int method, const SearchResult& result, double elapsed,
+                 size_t batched, bool cached, bool exact = false) {
+    ostringstream out;
+    out << "{\"ok\":true,\"probe\":\"" << jsonEscape(label) << "\",\"method\":\"" << methodName(method)
+        << "\"," << candidatesJson(g.records, result.hits, exact) << ",\"scored\":" << result.scored
+        << ",\"pruned\":" << result.pruned << ",\"batched\":" << batched
+        << ",\"cached\":" << (cached ? "true" : "false")
+        << ",\"elapsed_ms\":" << fixed << setprecision(3) << elapsed << "}";
+    return out.str();
+}
+
+struct ServerRequest {
+    string payload;
+    promise<string> reply;
+};
+
+struct ServerMatch {
+    shared_ptr<ServerRequest> request;
+    string label;
+    int method = METHOD_GRAPH;
+    size_t k = 10;
+    bool exact = false;   // shard-match: full-precision scores
+    vector<Minutiae> probe;
+};
+
+// Client threads only move frames. One dispatcher thread serves searches and
+// lookups in arrival order, each against the gallery version current when it
+// starts. Enrollments are handed to a writer thread that publishes one version
+// per batch, so searches never wait for them. An enrollment is answered once
+// its version is published: every request sent after the reply sees it.
+mutex serverQueueLock;
+condition_variable serverQueueReady, enrollQueueReady;
+deque<shared_ptr<ServerRequest>> serverQueue, enrollQueue;
+bool serverStopping = false;
+bool enrollStopping = false;   // set once the dispatcher has exited
+
+bool parseMatch(stringstream& ss, ServerMatch& m, string& error) {
+    string method;
+    int k = 0;
+    if (!(ss >> method >> k)) {
+        error = "usage: match <method> <k> <probe record>";
+        return false;
+    }
+    m.method = methodFromName(method);
+    if (m.method < 0) {
+        error = "unknown method: " + method;
+        return false;
+    }
+    if (k < 1 || k > (int)MAX_CANDIDATES) {
+        error = "k must be between 1 and " + to_string(MAX_CANDIDATES);
+        return false;
+    }
+    m.k = k;
+    ss >> ws;
+    getline(ss, m.label, '|');
+    Criminal probe;
+    parseRecordFields(ss, probe);
+    m.probe = move(probe.fingerprint);
+    if (m.probe.empty()) {
+        error = "no minutiae";
+        return false;
+    }
+    return true;
+}
+
+bool parseEnroll(stringstream& ss, Criminal& c) {
+    string token;
+    ss >> ws;
+    getline(ss, token, '|');
+    if (!parseIntField(token.data(), token.data() + token.size(), c.id)) return false;
+    parseRecordFields(ss, c);
+    return true;
+}
+
+// Writer thread: every enrollment queued together goes into one gallery version
+void serveEnrollments(const vector<shared_ptr<ServerRequest>>& requests) {
+    vector<Criminal> batch;
+    vector<size_t> owners;
+    vector<string> replies(requests.size());
+    for (size_t i = 0; i < requests.size(); ++i) {
+        stringstream ss(requests[i]->payload);
+        string verb;
+        ss >> verb;
+        Criminal c;
+        if (!parseEnroll(ss, c)) {
+            replies[i] = errorJson("usage: enroll <database record>");
+            continue;
+        }
+        batch.push_back(move(c));
+        owners.push_back(i);
+    }
+    vector<string> errors = enrollCriminals(batch);
+    for (size_t j = 0; j < batch.size(); ++j) {
+        if (!errors[j].empty()) {
+            replies[owners[j]] = errorJson(errors[j]);
+            continue;
+        }
+        logAction("enroll", batch[j].id, "server");
+        replies[owners[j]] = "{\"ok\":true,\"id\":" + to_string(batch[j].id) + "}";
+    }
+    for (size_t i = 0; i < requests.size(); ++i) requests[i]->reply.set_value(replies[i]);
+}
+
+string ringJson(const AccompliceGraph& g, int id) {
+    uint32_t v = g.vertexOf(id);
+    uint32_t root = g.components.root(v);
+    ostringstream out;
+    out << "{\"ok\":true,\"id\":" << id << ",\"size\":" << g.components.size[root]
+        << ",\"records\":" << g.components.records[root] << ",\"connections\":" << g.components.edges[root]
+        << ",\"members\":[";
+    vector<uint32_t> members = ringMembers(g, v, MAX_RING_MEMBERS);
+    for (size_t i = 0; i < members.size(); ++i) out << (i ? "," : "") << g.ids[members[i]];
+    out << "]}";
+    return out.str();
+}
+
+string pathJson(const AccompliceGraph& g, int fromId, int toId) {
+    size_t touched;
+    vector<uint32_t> path = separationPath(g, g.vertexOf(fromId), g.vertexOf(toId), touched);
+    ostringstream out;
+    out << "{\"ok\":true,\"from\":" << fromId << ",\"to\":" << toId << ",\"connected\":"
+        << (path.empty() ? "false" : "true") << ",\"separation\":" << (path.empty() ? -1 : (int)path.size() - 1)
+        << ",\"path\":[";
+    for (size_t i = 0; i < path.size(); ++i) out << (i ? "," : "") << g.ids[path[i]];
+    out << "],\"touched\":" << touched << "}";
+    return out.str();
+}
+
+string withinJson(const AccompliceGraph& g, int id, int hops) {
+    vector<uint32_t> order;
+    vector<int> degree;
+    walkNetwork(g, g.vertexOf(id), order, degree, true, hops);
+    ostringstream out;
+    out << "{\"ok\":true,\"id\":" << id << ",\"hops\":" << hops << ",\"members\":[";
+    for (size_t i = 1; i < order.size(); ++i)
+        out << (i > 1 ? "," : "") << "{\"id\":" << g.ids[order[i]] << ",\"hops\":" << degree[order[i]] << "}";
+    out << "]}";
+    return out.str();
+}
+
+string serveLookup(const string& verb, stringstream& ss) {
+    int id, other = 0;
+    bool needsOther = verb == "path" || verb == "within";
+    if (!(ss >> id) || (needsOther && !(ss >> other)))
+        return errorJson("usage: " + verb + (verb == "path" ? " <id> <id>" : verb == "within" ? " <id> <hops>" : " <id>"));
+    shared_ptr<const Gallery> g = currentGallery();
+    CriminalView c;
+    if (!g->records.find(id, c)) return errorJson("criminal not found: " + to_string(id));
+    if (verb == "path" && !g->records.contains(other)) return errorJson("criminal not found: " + to_string(other));
+    if (verb == "within" && other < 1) return errorJson("hops must be positive");
+    logAction("view", id, "server");
+    if (verb == "view") return criminalJson(c);
+    if (verb == "ring") return ringJson(g->network, id);
+    if (verb == "path") return pathJson(g->network, id, other);
+    if (verb == "within") return withinJson(g->network, id, other);
+    return networkJson(*g, id);
+}
+
+// Graph matches that arrive together are scored in one gallery pass; those
+// already in the probe cache are answered from it
+void serveGraphMatches(vector<ServerMatch>& pending) {
+    if (pending.empty()) return;
+    shared_ptr<const Gallery> g = currentGallery();
+    auto start = chrono::steady_clock::now();
+    vector<ProbeKey> keys;
+    vector<SearchResult> results(pending.size());
+    vector<bool> cached(pending.size());
+    vector<const vector<Minutiae>*> probes;
+    vector<size_t> misses;
+    size_t k = 1;
+    for (size_t q = 0; q < pending.size(); ++q) {
+        keys.push_back(probeKey(pending[q].probe, METHOD_GRAPH, pending[q].k));
+        cached[q] = probeCache.find(keys[q], g->version, results[q]);
+        if (cached[q]) continue;
+        probes.push_back(&pending[q].probe);
+        misses.push_back(q);
+        k = max(k, pending[q].k);
+    }
+    if (!probes.empty()) {
+        vector<SearchResult> scored = searchGraphBatch(*g, probes, k);
+        for (size_t j = 0; j < misses.size(); ++j) {
+            size_t q = misses[j];
+            results[q] = move(scored[j]);
+            // A top-k list is a prefix of any longer one, so the result is cacheable as is
+            if (results[q].hits.size() > pending[q].k) results[q].hits.resize(pending[q].k);
+            probeCache.store(move(keys[q]), g->version, results[q]);
+        }
+    }
+    double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    for (size_t q = 0; q < pending.size(); ++q) {
+        const SearchResult& result = results[q];
+        if (!result.hits.empty())
+            addToSearchHistory("match", result.hits[0].id, "server probe " + pending[q].label);
+        pending[q].request->reply.set_value(matchJson(*g, pending[q].label, METHOD_GRAPH, result, elapsed,
+                                                      cached[q] ? 1 : probes.size(), cached[q], pending[q].exact));
+    }
+    pending.clear();
+}
+
+void serveRequests(const vector<shared_ptr<ServerRequest>>& requests) {
+    vector<ServerMatch> pending;
+    for (const auto& request : requests) {
+        stringstream ss(request->payload);
+        string verb;
+        ss >> verb;
+        if (verb == "match" || verb == "shard-match") {
+            ServerMatch m;
+            string error;
+            if (!parseMatch(ss, m, error)) {
+                request->reply.set_value(errorJson(error));
+                continue;
+            }
+            m.request = request;
+            m.exact = verb == "shard-match";
+            if (m.method == METHOD_GRAPH) {
+                pending.push_back(move(m));
+                continue;
+            }
+            serveGraphMatches(pending);
+            shared_ptr<const Gallery> g = currentGallery();
+            auto start = chrono::steady_clock::now();
+            bool cached;
+            SearchResult result = cachedSearch(*g, m.probe, m.method, m.k, &cached);
+            double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            if (!result.hits.empty())
+                addToSearchHistory("match", result.hits[0].id, "server probe " + m.label);
+            request->reply.set_value(matchJson(*g, m.label, m.method, result, elapsed, 1, cached, m.exact));
+            continue;
+        }
+
+        if (verb == "enroll") {
+            {
+                lock_guard<mutex> lock(serverQueueLock);
+                enrollQueue.push_back(request);
+            }
+            enrollQueueReady.notify_one();
+            continue;
+        }
+
+        serveGraphMatches(pending);
+        if (verb == "view" || verb == "network" || verb == "ring" || verb == "path" || verb == "within")
+            request->reply.set_value(serveLookup(verb, ss));
+        else request->reply.set_value(errorJson("unknown request: " + verb));
+    }
+    serveGraphMatches(pending);
+}
+
+void dispatchLoop() {
+    while (true) {
+        vector<shared_ptr<ServerRequest>> requests;
+        {
+            unique_lock<mutex> lock(serverQueueLock);
+            serverQueueReady.wait(lock, [] { return serverStopping || !serverQueue.empty(); });
+            if (serverQueue.empty()) return;
+            requests.assign(serverQueue.begin(), serverQueue.end());
+            serverQueue.clear();
+        }
+        serveRequests(requests);
+    }
+}
+
+// Compaction is started by enrollments, so it is also polled from this thread
+void enrollLoop() {
+    while (true) {
+        vector<shared_ptr<ServerRequest>> requests;
+        {
+            unique_lock<mutex> lock(serverQueueLock);
+            enrollQueueReady.wait(lock, [] { return enrollStopping || !enrollQueue.empty(); });
+            if (enrollQueue.empty()) return;
+            requests.assign(enrollQueue.begin(), enrollQueue.end());
+            enrollQueue.clear();
+        }
+        pollCompaction(false);
+        serveEnrollments(requests);
+    }
+}
+
+#ifndef _WIN32
+bool readFull(int fd, char* data, size_t n) {
+    while (n > 0) {
+        ssize_t got = read(fd, data, n);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        data += got;
+        n -= got;
+    }
+    return true;
+}
+
+bool writeFull(int fd, const char* data, size_t n) {
+    while (n > 0) {
+        ssize_t sent = send(fd, data, n, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        data += sent;
+        n -= sent;
+    }
+    return true;
+}
+
+bool readFrame(int fd, string& payload) {
+    unsigned char header[4];
+    if (!readFull(fd, (char*)header, 4)) return false;
+    uint32_t length = (uint32_t)header[0] << 24 | (uint32_t)header[1] << 16 | (uint32_t)header[2] << 8 | header[3];
+    if (length > MAX_FRAME_BYTES) return false;
+    payload.resize(length);
+    return readFull(fd, &payload[0], length);
+}
+
+bool writeFrame(int fd, const string& payload) {
+    uint32_t length = payload.size();
+    unsigned char header[4] = {(unsigned char)(length >> 24), (unsigned char)(length >> 16),
+                               (unsigned char)(length >> 8), (unsigned char)length};
+    return writeFull(fd, (const char*)header, 4) && writeFull(fd, payload.data(), payload.size());
+}
+
+mutex clientsLock;
+condition_variable clientsDone;
+set<int> clientFds;
+volatile sig_atomic_t serverSignal = 0;
+
+void onServerSignal(int) { serverSignal = 1; }
+
+void clientFinished(int fd) {
+    close(fd);
+    lock_guard<mutex> lock(clientsLock);
+    clientFds.erase(fd);
+    clientsDone.notify_all();
+}
+
+// One thread per connection; each client has at most one request in flight
+void serveClient(int fd) {
+    string payload;
+    while (readFrame(fd, payload)) {
+        auto request = make_shared<ServerRequest>();
+        request->payload = move(payload);
+        future<string> reply = request->reply.get_future();
+        {
+            lock_guard<mutex> lock(serverQueueLock);
+            if (serverStopping) break;
+            serverQueue.push_back(request);
+        }
+        serverQueueReady.notify_one();
+        if (!writeFrame(fd, reply.get())) break;
+    }
+    clientFinished(fd);
+}
+
+bool socketAddress(const string& path, sockaddr_un& addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) return false;
+    strcpy(addr.sun_path, path.c_str());
+    return true;
+}
+
+bool serverLogin(const string& user, const string& mode) {
+    const char* password = getenv("FP_PASSWORD");
+    sessionUser = user;
+    if (!user.empty() && password && checkCredentials(user, password)) return true;
+    printError(string(1, (char)toupper(mode[0])) + mode.substr(1) + " mode needs --user and a valid FP_PASSWORD");
+    logAction("login-failed", NO_CRIMINAL, mode);
+    return false;
+}
+
+// Returns the listening socket, or -1 after reporting why there is none
+int listenOn(const string& path) {
+    sockaddr_un addr;
+    if (!socketAddress(path, addr)) {
+        printError("Socket path too long: " + path);
+        return -1;
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        printError("Cannot create socket");
+        return -1;
+    }
+    // A socket file nobody answers on is left over from a crashed server
+    if (connect(listener, (sockaddr*)&addr, sizeof(addr)) == 0) {
+        printError("A server is already listening on " + path);
+        close(listener);
+        return -1;
+    }
+    close(listener);
+    unlink(path.c_str());
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 64) != 0) {
+        printError("Cannot listen on " + path);
+        if (listener >= 0) close(listener);
+        return -1;
+    }
+    chmod(path.c_str(), 0600);
+    return listener;
+}
+
+// Hands each connection to its own thread until SIGINT or SIGTERM, then
+// closes the listener.
+void acceptClients(int listener, const string& path, void (*serve)(int)) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onServerSignal;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    while (!serverSignal) {
+        pollfd pfd = {listener, POLLIN, 0};
+        if (poll(&pfd, 1, 500) <= 0) continue;
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) continue;
+        lock_guard<mutex> lock(clientsLock);
+        clientFds.insert(fd);
+        thread(serve, fd).detach();
+    }
+    close(listener);
+    unlink(path.c_str());
+}
+
+// Wake clients blocked in read(); replies already under way are still sent
+void closeClients() {
+    unique_lock<mutex> lock(clientsLock);
+    for (int fd : clientFds) shutdown(fd, SHUT_RD);
+    clientsDone.wait(lock, [] { return clientFds.empty(); });
+}
+
+int runServer(const vector<string>& args) {
+    string path = socketFile, user;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "--user" && i + 1 < args.size()) user = args[++i];
+        else path = args[i];
+    }
+    if (!serverLogin(user, "server")) return 1;
+    int listener = listenOn(path);
+    if (listener < 0) return 1;
+
+    loadGallery();
+
+    thread dispatcher(dispatchLoop), enroller(enrollLoop);
+    logAction("server-start", NO_CRIMINAL, path);
+    printSuccess("Serving " + to_string(currentGallery()->records.size()) + " records on " + path);
+
+    acceptClients(listener, path, serveClient);
+    printInfo("Shutting down server...");
+    {
+        lock_guard<mutex> lock(serverQueueLock);
+        serverStopping = true;
+    }
+    serverQueueReady.notify_all();
+    closeClients();
+    dispatcher.join();
+    {
+        lock_guard<mutex> lock(serverQueueLock);
+        enrollStopping = true;
+    }
+    enrollQueueReady.notify_all();
+    enroller.join();
+    pollCompaction(true);
+    closeJournal();
+    dumpStatistics();
+    logAction("server-stop");
+    return 0;
+}
+#else
+int runServer(const vector<string>&) {
+    printError("Server mode needs Unix domain sockets");
+    return 1;
+}
+#endif
+
+// ================== SHARD COORDINATOR ==================
+// A gallery too large for one process is split into shards by ID, each served
+// by an ordinary match daemon in its own process:
+//   fingerprint --split-shards <n> <database> <prefix>
+//       writes <prefix>.<i>.bin holding the records whose ID mod n is i
+//   fingerprint --serve <prefix>.<i>.sock --data <prefix>.<i> --user <name>
+//       one worker per shard
+//   fingerprint --coordinate [socket] --user <name> --shard <socket> ...
+//       shard sockets in shard order
+// The coordinator speaks the daemon protocol. A match goes to every shard and
+// the per-shard top-k lists are merged; a shard that is down or slower than
+// --shard-timeout is left out and the reply is marked "partial". Requests
+// naming an ID go to the shard owning it, so network queries only follow
+// accomplice links between records of that shard.
+const size_t MAX_SHARDS = 256;
+int shardTimeoutMs = 5000;
+vector<string> shardSockets;
+
+size_t shardOf(int id, size_t shards) {
+    long long slot = id % (long long)shards;
+    return slot < 0 ? slot + shards : slot;
+}
+
+int splitShards(int shards, const string& inPath, const string& prefix) {
+    if (shards < 1 || shards > (int)MAX_SHARDS) {
+        printError("Shard count must be between 1 and " + to_string(MAX_SHARDS));
+        return 1;
+    }
+    RecordStore db;
+    MappedGallery source;
+    string error;
+    if (source.open(inPath, error)) loadFromGallery(source, db);
+    else loadTextDatabase(inPath, db);
+
+    vector<RecordStore> parts(shards);
+    for (CriminalView c : db) parts[shardOf(c.id, shards)].put(c.id, c.name, c.fingerprint, c.accomplices);
+    for (int i = 0; i < shards; ++i) {
+        string base = prefix + "." + to_string(i);
+        if (!writeGalleryFile(base + ".bin", parts[i])) {
+            printError("Failed to write " + base + ".bin");
+            return 1;
+        }
+        // A journal or index left by an earlier split describes other records
+        remove((base + ".journal").c_str());
+        remove((base + ".tidx").c_str());
+        printInfo(base + ".bin: " + to_string(parts[i].size()) + " records");
+    }
+    printSuccess("Split " + to_string(db.size()) + " records into " + to_string(shards) + " shards");
+    return 0;
+}
+
+#ifndef _WIN32
+// Each client thread keeps its own connection to every shard, opened on first
+// use and reopened after a failure, so a restarted worker is picked up again.
+struct ShardLink {
+    int fd = -1;
+
+    void drop() {
+        if (fd >= 0) close(fd);
+        fd = -1;
+    }
+};
+
+bool shardConnect(ShardLink& link, const string& path) {
+    if (link.fd >= 0) return true;
+    sockaddr_un addr;
+    if (!socketAddress(path, addr)) return false;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    timeval timeout = {shardTimeoutMs / 1000, (shardTimeoutMs % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return false;
+    }
+    link.fd = fd;
+    return true;
+}
+
+// Sending on the connection of a worker that has since exited fails at once,
+// so one reconnect is tried before the shard counts as down.
+bool shardSend(ShardLink& link, const string& path, const string& payload) {
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (!shardConnect(link, path)) return false;
+        if (writeFrame(link.fd, payload)) return true;
+        link.drop();
+    }
+    return false;
+}
+
+bool shardReceive(ShardLink& link, string& reply) {
+    if (link.fd >= 0 && readFrame(link.fd, reply)) return true;
+    link.drop();
+    return false;
+}
+
+// Value of a numeric field in a reply we produced ourselves; 0 if absent
+double jsonNumber(const string& json, const string& key) {
+    size_t pos = json.find("\"" + key + "\":");
+    return pos == string::npos ? 0 : strtod(json.c_str() + pos + key.size() + 3, nullptr);
+}
+
+struct ShardCandidate {
+    double score;  // full precision, for ranking
+    int id;
+    string json;   // the shard's candidate object, re-ranked and rounded on output
+};
+
+// Splits the candidate list of a shard's match reply into its objects. Names
+// are escaped, so inside a string every quote follows a backslash.
+vector<ShardCandidate> shardCandidates(const string& reply) {
+    vector<ShardCandidate> out;
+    size_t pos = reply.find("\"candidates\":[");
+    if (pos == string::npos) return out;
+    pos += 14;
+    while (pos < reply.size() && reply[pos] == '{') {
+        size_t end = pos;
+        bool quoted = false;
+        for (; end < reply.size(); ++end) {
+            if (quoted) {
+                if (reply[end] == '\\') ++end;
+                else if (reply[end] == '"') quoted = false;
+            } else if (reply[end] == '"') {
+                quoted = true;
+            } else if (reply[end] == '}') {
+                break;
+            }
+        }
+        if (end >= reply.size()) break;
+        ShardCandidate c;
+        c.json = reply.substr(pos, end + 1 - pos);
+        c.id = (int)jsonNumber(c.json, "id");
+        c.score = jsonNumber(c.json, "score");
+        out.push_back(move(c));
+        pos = end + 1;
+        if (pos < reply.size() && reply[pos] == ',') ++pos;
     }
+    return out;
+}
 
-    for (int y = min_y; y < max_y; y += ZONE_SIZE) {
-        for (int x = min_x; x < max_x; x += ZONE_SIZE) {
-            Zone zone;
-            zone.x_center = x + ZONE_SIZE/2;
-            zone.y_center = y + ZONE_SIZE/2;
-            double orientationSum = 0;
-            int count = 0;
-
-            for (const auto& m : fingerprint) {
-                if (m.x >= x && m.x < x + ZONE_SIZE && 
-                    m.y >= y && m.y < y + ZONE_SIZE) {
-                    zone.minutiae.push_back(m);
-                    orientationSum += m.orientation;
-                    count++;
-                }
-            }
+// The probe is sent to every shard before any reply is read, so the shards
+// search in parallel. Shards are asked for unrounded scores so that ties
+// between shards order as they would in one gallery.
+string coordinateMatch(stringstream& ss, const string& payload, vector<ShardLink>& links) {
+    ServerMatch m;
+    string error;
+    if (!parseMatch(ss, m, error)) return errorJson(error);
 
-            if (count > 0) {
-                zone.avgOrientation = orientationSum / count;
-                zones.push_back(zone);
-            }
+    auto start = chrono::steady_clock::now();
+    string request = "shard-" + payload.substr(payload.find("match"));
+    vector<char> sent(links.size());
+    for (size_t i = 0; i < links.size(); ++i) sent[i] = shardSend(links[i], shardSockets[i], request);
+
+    vector<ShardCandidate> merged;
+    vector<size_t> down;
+    long long scored = 0, pruned = 0;
+    for (size_t i = 0; i < links.size(); ++i) {
+        string reply;
+        if (!sent[i] || !shardReceive(links[i], reply) || reply.compare(0, 11, "{\"ok\":true,") != 0) {
+            down.push_back(i);
+            continue;
         }
+        for (auto& c : shardCandidates(reply)) merged.push_back(move(c));
+        scored += (long long)jsonNumber(reply, "scored");
+        pruned += (long long)jsonNumber(reply, "pruned");
     }
+    if (down.size() == links.size()) return errorJson("no shard answered");
 
-    sort(zones.begin(), zones.end(), [](const Zone& a, const Zone& b) {
-        return a.minutiae.size() > b.minutiae.size();
+    sort(merged.begin(), merged.end(), [](const ShardCandidate& a, const ShardCandidate& b) {
+        return a.score < b.score || (a.score == b.score && a.id < b.id);
     });
+    if (merged.size() > m.k) merged.resize(m.k);
+    double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
 
-    if (zones.size() > MAX_ZONES) zones.resize(MAX_ZONES);
-    return zones;
+    ostringstream out;
+    out << "{\"ok\":true,\"probe\":\"" << jsonEscape(m.label) << "\",\"method\":\"" << methodName(m.method)
+        << "\",\"candidates\":[";
+    for (size_t rank = 0; rank < merged.size(); ++rank) {
+        const string& json = merged[rank].json;
+        size_t fields = json.find(','), score = json.find(",\"score\":");
+        out << (rank ? "," : "") << "{\"rank\":" << rank + 1 << json.substr(fields, score + 1 - fields)
+            << scoreJson(merged[rank].score) << "}";
+    }
+    out << "],\"scored\":" << scored << ",\"pruned\":" << pruned << ",\"shards\":" << links.size()
+        << ",\"partial\":" << (down.empty() ? "false" : "true") << ",\"shards_down\":[";
+    for (size_t i = 0; i < down.size(); ++i) out << (i ? "," : "") << down[i];
+    out << "],\"elapsed_ms\":" << fixed << setprecision(3) << elapsed << "}";
+    return out.str();
 }
 
-double compareZonalMatching(const vector<Minutiae>& fp1, const vector<Minutiae>& fp2) {
-    auto zones1 = createZones(fp1);
-    auto zones2 = createZones(fp2);
-    double totalScore = 0;
-    int comparedZones = 0;
+string coordinateRequest(const string& payload, vector<ShardLink>& links) {
+    stringstream ss(payload);
+    string verb;
+    ss >> verb;
+    if (verb == "match") return coordinateMatch(ss, payload, links);
+    if (verb != "enroll" && verb != "view" && verb != "network" && verb != "ring" && verb != "path" &&
+        verb != "within")
+        return errorJson("unknown request: " + verb);
 
-    for (const auto& zone1 : zones1) {
-        for (const auto& zone2 : zones2) {
-            double dist = hypot(zone1.x_center - zone2.x_center, 
-                               zone1.y_center - zone2.y_center);
-            if (dist > ZONE_SIZE * 1.5) continue;
-            
-            double orientationDiff = min(
-                abs(zone1.avgOrientation - zone2.avgOrientation),
-                360 - abs(zone1.avgOrientation - zone2.avgOrientation)
-            );
-            
-            double countRatio = min(
-                zone1.minutiae.size() / (double)zone2.minutiae.size(),
-                zone2.minutiae.size() / (double)zone1.minutiae.size()
-            );
-            
-            double zoneScore = (1 - orientationDiff/180.0) * countRatio;
-            totalScore += zoneScore;
-            comparedZones++;
-            break;
-        }
+    // A request without a readable ID goes to shard 0, which answers with the
+    // usual usage error
+    string token;
+    ss >> ws;
+    getline(ss, token, verb == "enroll" ? '|' : ' ');
+    size_t shard = 0;
+    int id;
+    if (parseIntField(token.data(), token.data() + token.size(), id)) shard = shardOf(id, links.size());
+
+    string reply;
+    if (!shardSend(links[shard], shardSockets[shard], payload) || !shardReceive(links[shard], reply))
+        return errorJson("shard " + to_string(shard) + " is unavailable");
+    return reply;
+}
+
+void coordinateClient(int fd) {
+    vector<ShardLink> links(shardSockets.size());
+    string payload;
+    while (readFrame(fd, payload)) {
+        if (!writeFrame(fd, coordinateRequest(payload, links))) break;
     }
-    
-    return comparedZones > 0 ? (1.0 - totalScore/comparedZones) : 1.0;
+    for (auto& link : links) link.drop();
+    clientFinished(fd);
 }
 
-// ================== CORE FUNCTIONS ==================
-void addCriminal() {
-    printHeader("ADD NEW CRIMINAL RECORD");
-    Criminal c;
-    
-    cout << "Enter ID: ";
-    while (!(cin >> c.id) || criminalDB.find(c.id) != criminalDB.end()) {
-        printError("Invalid ID or ID already exists!");
-        cin.clear();
-        cin.ignore(numeric_limits<streamsize>::max(), '\n');
-        cout << "Enter ID: ";
+int runCoordinator(const vector<string>& args) {
+    string path = socketFile, user;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "--user" && i + 1 < args.size()) user = args[++i];
+        else if (args[i] == "--shard" && i + 1 < args.size()) shardSockets.push_back(args[++i]);
+        else path = args[i];
     }
-    
-    cout << "Enter name: ";
-    cin.ignore();
-    getline(cin, c.name);
-    
-    cout << "Enter number of minutiae points: ";
-    int n;
-    while (!(cin >> n) || n <= 0) {
-        printError("Please enter a positive number!");
-        cin.clear();
-        cin.ignore(numeric_limits<streamsize>::max(), '\n');
-        cout << "Enter number of minutiae points: ";
+    if (!serverLogin(user, "coordinator")) return 1;
+    if (shardSockets.empty() || shardSockets.size() > MAX_SHARDS) {
+        printError("Coordinator needs between 1 and " + to_string(MAX_SHARDS) + " --shard sockets");
+        return 1;
     }
-    
-    for (int i = 0; i < n; ++i) {
-        Minutiae m;
-        cout << "\nMinutiae Point #" << i + 1 << ":\n";
-        cout << "X coordinate: ";
-        cin >> m.x;
-        cout << "Y coordinate: ";
-        cin >> m.y;
-        cout << "Angle (0-359 degrees): ";
-        cin >> m.angle;
-        cout << "Type (R for Ridge ending, B for Bifurcation): ";
-        cin >> m.type;
-        cout << "Orientation (0.0-1.0): ";
-        cin >> m.orientation;
-        c.fingerprint.push_back(m);
+    int listener = listenOn(path);
+    if (listener < 0) return 1;
+
+    for (size_t i = 0; i < shardSockets.size(); ++i) {
+        ShardLink link;
+        if (!shardConnect(link, shardSockets[i])) printWarning("Shard " + to_string(i) + " is not answering on " + shardSockets[i]);
+        link.drop();
     }
-    
-    cout << "Number of accomplices: ";
-    int a;
-    cin >> a;
-    if (a > 0) {
-        cout << "Enter accomplice IDs (space separated): ";
-        for (int i = 0; i < a; ++i) {
-            int aid;
-            cin >> aid;
-            c.accomplices.push_back(aid);
-        }
+    logAction("coordinator-start", NO_CRIMINAL, path);
+    printSuccess("Coordinating " + to_string(shardSockets.size()) + " shards on " + path);
+
+    acceptClients(listener, path, coordinateClient);
+    printInfo("Shutting down coordinator...");
+    closeClients();
+    logAction("coordinator-stop");
+    return 0;
+}
+#else
+int runCoordinator(const vector<string>&) {
+    printError("Coordinator mode needs Unix domain sockets");
+    return 1;
+}
+#endif
+
+// ================== BENCHMARKS ==================
+// Built as a separate binary:
+//   g++ -std=c++17 -O2 -pthread -DFINGERPRINT_BENCH main.cpp -o fingerprint_bench
+// Writes a seeded synthetic gallery plus noisy probes derived from it, then
+// times the matching, loading and network paths on that data.
+#ifdef FINGERPRINT_BENCH
+
+// splitmix64: the same seed gives the same gallery with any standard library
+struct BenchRandom {
+    uint64_t state;
+    explicit BenchRandom(uint64_t seed) : state(seed) {}
+    uint64_t next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
     }
-    
-    criminalDB[c.id] = c;
-    saveCriminalDB();
-    buildAccompliceGraph();
-    printSuccess("Criminal record added successfully!");
-    logAction("Added criminal ID: " + to_string(c.id));
+    int range(int lo, int hi) { return lo + (int)(next() % (uint64_t)(hi - lo + 1)); }
+};
+
+struct BenchConfig {
+    size_t templates = 10000;
+    int minMinutiae = 30, maxMinutiae = 60;
+    size_t probes = 50;
+    int noise = 4;                 // probe jitter in pixels
+    uint64_t seed = 1;
+    size_t pairs = 20000;          // pairwise comparator samples
+    size_t loadRuns = 3;
+    size_t bfsSamples = 200;
+    string dir = ".";
+    string json;
+    bool generateOnly = false;
+};
+
+struct BenchResult {
+    string name;
+    size_t samples = 0;
+    double throughput = 0;     // operations per second
+    double p50 = 0, p99 = 0;   // microseconds
+    long peakRssKb = 0;        // process peak so far
+    double accuracy = -1;      // rank-1 hit rate for search benchmarks
+};
+
+long peakRssKb() {
+#ifndef _WIN32
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+#else
+    return 0;
+#endif
 }
 
-void viewCriminal(int id) {
-    if (criminalDB.find(id) == criminalDB.end()) {
-        printError("Criminal not found!");
-        return;
+Minutiae randomMinutia(BenchRandom& rng) {
+    Minutiae m;
+    m.x = rng.range(0, 499);
+    m.y = rng.range(0, 499);
+    m.angle = rng.range(0, 359);
+    m.type = rng.range(0, 9) < 6 ? 'R' : 'B';
+    m.orientation = rng.range(0, 100) / 100.0;
+    return m;
+}
+
+// A probe is the source template with minutiae dropped, jittered and a few
+// spurious points added; its label "P<n>-<id>" names the true match
+vector<Minutiae> noisyProbe(const vector<Minutiae>& source, int noise, BenchRandom& rng) {
+    vector<Minutiae> probe;
+    for (Minutiae m : source) {
+        if (rng.range(0, 99) < 15) continue;
+        m.x += rng.range(-noise, noise);
+        m.y += rng.range(-noise, noise);
+        m.angle = (m.angle + rng.range(-5, 5) + 360) % 360;
+        probe.push_back(m);
     }
-    
-    Criminal& c = criminalDB[id];
-    printHeader("CRIMINAL DETAILS #" + to_string(id));
-    cout << COLOR_BOLD << "Name: " << COLOR_RESET << c.name << "\n";
-    cout << COLOR_BOLD << "Fingerprint Points: " << COLOR_RESET << c.fingerprint.size() << "\n";
-    
-    if (!c.accomplices.empty()) {
-        cout << COLOR_BOLD << "Accomplices: " << COLOR_RESET;
-        for (int aid : c.accomplices) {
-            cout << aid << " ";
+    for (int extra = rng.range(0, 3); extra > 0; --extra) probe.push_back(randomMinutia(rng));
+    return probe;
+}
+
+void writeRecordFields(ostream& out, const vector<Minutiae>& fp) {
+    for (auto& m : fp)
+        out << "|" << m.x << "|" << m.y << "|" << m.angle << "|" << m.type << "|" << m.orientation;
+}
+
+// Streams the gallery so 10^7 templates never have to fit in memory at once
+bool generateBenchData(const BenchConfig& cfg, const string& galleryPath, const string& probePath) {
+    BenchRandom rng(cfg.seed);
+    unordered_map<int, vector<size_t>> probeSources;
+    for (size_t p = 0; p < cfg.probes; ++p) probeSources[rng.range(1, (int)cfg.templates)].push_back(p);
+    vector<string> probeLines(cfg.probes);
+
+    ofstream gout(galleryPath, ios::trunc);
+    for (size_t id = 1; id <= cfg.templates; ++id) {
+        vector<Minutiae> fp(rng.range(cfg.minMinutiae, cfg.maxMinutiae));
+        for (auto& m : fp) m = randomMinutia(rng);
+        gout << id << "|Subject " << id;
+        writeRecordFields(gout, fp);
+        gout << "|AC";
+        for (int a = rng.range(0, 3); a > 0; --a) {
+            int accomplice = rng.range(1, (int)cfg.templates);
+            if (accomplice != (int)id) gout << "|" << accomplice;
+        }
+        gout << "\n";
+
+        auto sources = probeSources.find(id);
+        if (sources == probeSources.end()) continue;
+        for (size_t p : sources->second) {
+            ostringstream line;
+            line << "P" << p << "-" << id << "|probe";
+            writeRecordFields(line, noisyProbe(fp, cfg.noise, rng));
+            probeLines[p] = line.str();
         }
-        cout << "\n";
-    } else {
-        cout << COLOR_BOLD << "Accomplices: " << COLOR_RESET << "None\n";
     }
-    
-    logAction("Viewed criminal ID: " + to_string(id));
-    addToSearchHistory("Viewed Criminal ID: " + to_string(id));
+    gout.close();
+
+    ofstream pout(probePath, ios::trunc);
+    for (auto& line : probeLines) pout << line << "\n";
+    pout.close();
+    return gout && pout;
 }
 
-void matchFingerprint() {
-    printHeader("FINGERPRINT MATCHING SYSTEM");
-    cout << COLOR_BLUE << "=== (Ridge & Bifurcation Analysis) ===\n" << COLOR_RESET;
-    
-    // Collect fingerprint sample
-    cout << "\nEnter number of minutiae points: ";
-    int n;
-    while (!(cin >> n) || n <= 0) {
-        printError("Please enter a positive number!");
-        cin.clear();
-        cin.ignore(numeric_limits<streamsize>::max(), '\n');
-        cout << "Enter number of minutiae points: ";
+// Times body(i) for i in [0, samples)
+template <typename Body>
+BenchResult runBench(const string& name, size_t samples, const Body& body) {
+    vector<double> times;
+    times.reserve(samples);
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < samples; ++i) {
+        auto t0 = chrono::steady_clock::now();
+        body(i);
+        times.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - t0).count());
     }
+    double total = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-    vector<Minutiae> testPrint(n);
-    for (int i = 0; i < n; ++i) {
-        cout << "\nPoint " << i + 1 << " details:\n";
-        cout << "Type (R for Ridge, B for Bifurcation): ";
-        cin >> testPrint[i].type;
-        cout << "Coordinates (x y): ";
-        cin >> testPrint[i].x >> testPrint[i].y;
-        cout << "Angle (0-359 degrees): ";
-        cin >> testPrint[i].angle;
-        if (testPrint[i].type == 'R') {
-            cout << "Ridge count from reference: ";
-            cin >> testPrint[i].orientation;
-        }
+    BenchResult r;
+    r.name = name;
+    r.samples = samples;
+    if (samples) {
+        sort(times.begin(), times.end());
+        // nearest-rank percentiles
+        r.p50 = times[(size_t)ceil(0.50 * samples) - 1];
+        r.p99 = times[(size_t)ceil(0.99 * samples) - 1];
+        r.throughput = total > 0 ? samples / total : 0;
     }
+    r.peakRssKb = peakRssKb();
+    return r;
+}
 
-    // Add method selection back in
-    cout << "\n" << COLOR_BOLD << "Select matching method:" << COLOR_RESET << "\n";
-    cout << "1. Graph-based matching (precise point comparison)\n";
-    cout << "2. Zonal-based matching (regional characteristics)\n";
-    cout << "Your choice (1-2): ";
-    
-    int method;
-    while (!(cin >> method) || (method != 1 && method != 2)) {
-        printError("Please enter 1 or 2!");
-        cin.clear();
-        cin.ignore(numeric_limits<streamsize>::max(), '\n');
-        cout << "Your choice (1-2): ";
+void printBenchResult(const BenchResult& r) {
+    cout << left << setw(22) << r.name << right << setw(9) << r.samples
+         << fixed << setprecision(1) << setw(14) << r.throughput
+         << setprecision(2) << setw(14) << r.p50 << setw(14) << r.p99
+         << setw(12) << r.peakRssKb;
+    if (r.accuracy >= 0) cout << "   rank-1 " << setprecision(1) << 100 * r.accuracy << "%";
+    cout << "\n";
+}
+
+bool writeBenchJson(const string& path, const BenchConfig& cfg, const vector<BenchResult>& results) {
+    ofstream out(path, ios::trunc);
+    out << "{\"version\":1,\"timestamp\":" << time(nullptr)
+        << ",\"config\":{\"templates\":" << cfg.templates << ",\"minutiae_min\":" << cfg.minMinutiae
+        << ",\"minutiae_max\":" << cfg.maxMinutiae << ",\"probes\":" << cfg.probes
+        << ",\"noise\":" << cfg.noise << ",\"seed\":" << cfg.seed << ",\"threads\":" << searchPool().size()
+        << ",\"pair_kernel\":\"" << pairKernelName << "\"},\"results\":[";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        out << (i ? "," : "") << "{\"name\":\"" << r.name << "\",\"samples\":" << r.samples
+            << fixed << setprecision(3) << ",\"throughput_per_s\":" << r.throughput
+            << ",\"p50_us\":" << r.p50 << ",\"p99_us\":" << r.p99 << ",\"peak_rss_kb\":" << r.peakRssKb;
+        if (r.accuracy >= 0) out << ",\"rank1_accuracy\":" << setprecision(4) << r.accuracy;
+        out << "}";
     }
+    out << "]}\n";
+    out.close();
+    return (bool)out;
+}
 
-    // Perform matching
-    printInfo("Analyzing fingerprint...");
-    
-    double bestScore = (method == 1) ? 1e9 : 1.0; // Lower is better for graph, higher for zonal
-    int bestID = -1;
-    Criminal* bestMatch = nullptr;
-    int ridgeMatches = 0, bifurcationMatches = 0;
-
-    for (auto it = criminalDB.begin(); it != criminalDB.end(); ++it) {
-        int id = it->first;
-        Criminal& crim = it->second;
-        double score;
-        int currentRidgeMatches = 0;
-        int currentBifurcationMatches = 0;
-        
-        if (method == 1) {
-            // Graph-based matching
-            int matches = 0;
-            for (auto& m1 : testPrint) {
-                for (auto& m2 : crim.fingerprint) {
-                    if (m1.type != m2.type) continue;
-                    double dist = hypot(m1.x - m2.x, m1.y - m2.y);
-                    double angleDiff = min(abs(m1.angle - m2.angle), 360 - abs(m1.angle - m2.angle));
-                    if (dist <= 10 && angleDiff <= 20) {
-                        matches++;
-                        if (m1.type == 'R') currentRidgeMatches++;
-                        else currentBifurcationMatches++;
-                        break; // Match found for this test point
-                    }
-                }
-            }
-            score = 1.0 - (double)matches / max(testPrint.size(), crim.fingerprint.size());
-        } else {
-            // Zonal-based matching
-            score = compareZonalMatching(testPrint, crim.fingerprint);
+// Swallows the interactive output of the functions being timed
+struct NullBuffer : streambuf {
+    int overflow(int c) override { return c; }
+};
+
+int runBenchmarks(const vector<string>& args) {
+    BenchConfig cfg;
+    for (size_t i = 0; i < args.size(); ++i) {
+        bool hasValue = i + 1 < args.size();
+        if (args[i] == "--templates" && hasValue) cfg.templates = max(1LL, atoll(args[++i].c_str()));
+        else if (args[i] == "--minutiae" && hasValue) {
+            string range = args[++i];
+            size_t dash = range.find('-');
+            cfg.minMinutiae = max(1, atoi(range.c_str()));
+            cfg.maxMinutiae = dash == string::npos ? cfg.minMinutiae : max(cfg.minMinutiae, atoi(range.c_str() + dash + 1));
         }
-        
-        if ((method == 1 && score < bestScore) || (method == 2 && score < bestScore)) {
-            bestScore = score;
-            bestID = id;
-            bestMatch = &crim;
-            ridgeMatches = currentRidgeMatches;
-            bifurcationMatches = currentBifurcationMatches;
+        else if (args[i] == "--probes" && hasValue) cfg.probes = max(1, atoi(args[++i].c_str()));
+        else if (args[i] == "--noise" && hasValue) cfg.noise = max(0, atoi(args[++i].c_str()));
+        else if (args[i] == "--seed" && hasValue) cfg.seed = strtoull(args[++i].c_str(), nullptr, 10);
+        else if (args[i] == "--pairs" && hasValue) cfg.pairs = max(1, atoi(args[++i].c_str()));
+        else if (args[i] == "--load-runs" && hasValue) cfg.loadRuns = max(1, atoi(args[++i].c_str()));
+        else if (args[i] == "--bfs-samples" && hasValue) cfg.bfsSamples = max(1, atoi(args[++i].c_str()));
+        else if (args[i] == "--dir" && hasValue) cfg.dir = args[++i];
+        else if (args[i] == "--json" && hasValue) cfg.json = args[++i];
+        else if (args[i] == "--generate-only") cfg.generateOnly = true;
+        else {
+            cout << "Usage: fingerprint_bench [--templates n] [--minutiae min-max] [--probes n] [--noise px]\n"
+                 << "                         [--seed s] [--pairs n] [--load-runs n] [--bfs-samples n]\n"
+                 << "                         [--dir path] [--json file] [--generate-only]\n";
+            return 1;
         }
     }
+    string base = cfg.dir + "/bench_";
+    string probePath = base + "probes.txt";
+    databaseFile = base + "gallery.txt";
+    galleryFile = base + "gallery.bin";
+    journalFile = base + "gallery.journal";
+    tripletIndexFile = base + "gallery.tidx";
+    if (cfg.json.empty()) cfg.json = base + "results.json";
+    remove(galleryFile.c_str());
+    remove(journalFile.c_str());
+    remove(tripletIndexFile.c_str());
 
-    // Display results
-    printHeader("FINGERPRINT MATCH RESULT");
-    
-    if (bestID == -1) {
-        printError("No matching fingerprint found in database!");
-    } else {
-        double confidence = 100 * (1.0 - bestScore);
-        
-        // Main match result
-        cout << "+---------------------------------------+\n";
-        cout << "| " << COLOR_BOLD << "Match: Criminal #" << bestID << " (" << bestMatch->name << ")" << COLOR_RESET << " |\n";
-        cout << "| " << COLOR_BOLD << "Confidence: " << fixed << setprecision(2) 
-             << ((confidence > 99.995) ? 100.00 : confidence) << "%" << COLOR_RESET << " |\n";
-        cout << "+---------------------------------------+\n\n";
+    printInfo("Generating " + to_string(cfg.templates) + " templates and " + to_string(cfg.probes) + " probes...");
+    if (!generateBenchData(cfg, databaseFile, probePath)) {
+        printError("Failed to write benchmark data under " + cfg.dir);
+        return 1;
+    }
+    printSuccess("Wrote " + databaseFile + " and " + probePath);
+    if (cfg.generateOnly) return 0;
 
-        // Detailed analysis
-        printHeader("DETAILED ANALYSIS");
-        cout << "+---------------------------------------+\n";
-        cout << "| " << COLOR_BOLD << "Ridge endings matched: " << ridgeMatches << COLOR_RESET << " |\n";
-        cout << "| " << COLOR_BOLD << "Bifurcations matched: " << bifurcationMatches << COLOR_RESET << " |\n";
-        cout << "| " << COLOR_BOLD << "Total minutiae points: " << testPrint.size() << COLOR_RESET << " |\n";
-        cout << "+---------------------------------------+\n";
-        
-        // Show ridge counts if available
-        bool hasRidgeCounts = false;
-        for (auto& m : testPrint) {
-            if (m.type == 'R' && m.orientation != 0) {
-                hasRidgeCounts = true;
-                break;
-            }
+    vector<pair<int, vector<Minutiae>>> probes;   // true ID, probe
+    {
+        ifstream fin(probePath);
+        string line;
+        while (getline(fin, line)) {
+            stringstream ss(line);
+            string label;
+            getline(ss, label, '|');
+            Criminal probe;
+            parseRecordFields(ss, probe);
+            probes.emplace_back(atoi(label.c_str() + label.find('-') + 1), probe.fingerprint);
         }
-        
-        if (hasRidgeCounts) {
-            cout << "\n" << COLOR_BLUE << "Ridge Counts from Reference:\n";
-            for (int i = 0; i < testPrint.size(); i++) {
-                if (testPrint[i].type == 'R') {
-                    cout << "- Point " << i+1 << ": " << testPrint[i].orientation << "\n";
-                }
-            }
-            cout << COLOR_RESET;
+    }
+
+    vector<BenchResult> results;
+    auto record = [&](BenchResult r) {
+        printBenchResult(r);
+        results.push_back(r);
+    };
+    printHeader("BENCHMARKS (" + to_string(cfg.templates) + " templates, " + to_string(searchPool().size())
+                + " threads, " + pairKernelName + " kernel)");
+    cout << left << setw(22) << "benchmark" << right << setw(9) << "samples" << setw(14) << "ops/s"
+         << setw(14) << "p50 us" << setw(14) << "p99 us" << setw(12) << "peak KB" << "\n";
+
+    shared_ptr<Gallery> loaded;
+    auto load = [&](size_t) {
+        loaded.reset();
+        loaded = make_shared<Gallery>();
+        loadCriminalDB(loaded->records, loaded->columns);
+    };
+    auto save = [&](size_t) { saveCriminalDB(galleryRecords(loaded)); };
+    record(runBench("load_text", cfg.loadRuns, load));
+    record(runBench("save_text", cfg.loadRuns, save));
+    writeGalleryFile(galleryFile, loaded->records);
+    record(runBench("load_binary", cfg.loadRuns, load));
+    record(runBench("save_binary", cfg.loadRuns, save));
+    record(runBench("triplet_index_build", 1, [&](size_t) {
+        loadTripletIndex(loaded->triplets, loaded->columns, loaded->records);
+        loaded->indexed = true;
+    }));
+    buildAccompliceGraph(loaded->network, loaded->records);
+    installGallery(loaded);
+    const Gallery& g = *loaded;
+
+    vector<CriminalView> templates;
+    for (CriminalView c : g.records) templates.push_back(c);
+    BenchRandom rng(cfg.seed ^ 0x5EED);
+    vector<size_t> partners(cfg.pairs);
+    for (auto& p : partners) p = rng.next() % templates.size();
+    auto probeAt = [&](size_t i) -> const vector<Minutiae>& { return probes[i % probes.size()].second; };
+
+    volatile double sink = 0;
+    record(runBench("createZones", cfg.pairs, [&](size_t i) {
+        sink = sink + createZones(templates[partners[i]].fingerprint).size();
+    }));
+    record(runBench("compareGraph", cfg.pairs, [&](size_t i) {
+        sink = sink + compareGraphBasedMatching(probeAt(i), templates[partners[i]].fingerprint);
+    }));
+    record(runBench("compareZonal", cfg.pairs, [&](size_t i) {
+        sink = sink + compareZonalMatching(probeAt(i), templates[partners[i]].fingerprint);
+    }));
+
+    // The packed gallery columns must reproduce the plain Minutiae scores: graph
+    // scores exactly, zonal scores up to the single-precision zone orientation.
+    // Each probe is checked against its true template and one random template.
+    const double ZONAL_TOLERANCE = 1e-6;
+    double graphError = 0, zonalError = 0;
+    size_t checked = 0;
+    for (size_t i = 0; i < probes.size(); ++i) {
+        size_t truth = g.records.slotOf(probes[i].first);
+        size_t indices[2] = {truth != RecordStore::npos ? truth : partners[0],
+                             partners[i % partners.size()]};
+        vector<Zone> probeZones = createZones(probes[i].second);
+        for (size_t index : indices) {
+            MinutiaeSpan fp = templates[index].fingerprint;
+            bool pruned;
+            graphError = max(graphError, fabs(compareGraphBasedMatching(probes[i].second, fp) -
+                                              compareGraphBasedMatching(probes[i].second, g.columns, index)));
+            zonalError = max(zonalError, fabs(compareZonalMatching(probes[i].second, fp) -
+                                              compareZonalMatching(probeZones, g.columns, index,
+                                                                   numeric_limits<double>::infinity(), pruned)));
+            checked++;
         }
+    }
+    ostringstream check;
+    check << "Packed templates (" << fixed << setprecision(1)
+          << (double)g.columns.bytes() / max<size_t>(1, g.columns.xs.size()) << " bytes/minutia): "
+          << checked << " pairs, max graph error " << scientific << setprecision(1) << graphError
+          << ", max zonal error " << zonalError << " (tolerance " << ZONAL_TOLERANCE << ")";
+    if (graphError > 0 || zonalError > ZONAL_TOLERANCE) {
+        printError(check.str());
+        return 1;
+    }
+    printSuccess(check.str());
 
-        // Show network option
-        cout << "\n" << COLOR_BOLD << "View accomplice network for this criminal? (y/n): " << COLOR_RESET;
-        char choice;
-        cin >> choice;
-        if (choice == 'y' || choice == 'Y') {
-            showAccompliceNetwork(bestID);
+    // The gallery scan behind matchFingerprint(), per method
+    for (int method = METHOD_GRAPH; method <= METHOD_INDEXED; ++method) {
+        size_t hits = 0;
+        BenchResult r = runBench(string("search_") + methodName(method), probes.size(), [&](size_t i) {
+            SearchResult result = searchGallery(g, probes[i].second, method, 10);
+            if (!result.hits.empty() && result.hits[0].id == probes[i].first) hits++;
+        });
+        r.accuracy = probes.empty() ? 0 : (double)hits / probes.size();
+        record(r);
+    }
+
+    // Resubmitted probes: every graph search is a probe cache hit
+    for (const auto& probe : probes) cachedSearch(g, probe.second, METHOD_GRAPH, 10);
+    record(runBench("search_cached", probes.size(), [&](size_t i) {
+        sink = sink + cachedSearch(g, probes[i].second, METHOD_GRAPH, 10).hits.size();
+    }));
+
+    // All-pairs deduplication, one tile of the triangle per iteration
+    vector<MinutiaeSpan> dedupProbes(g.columns.size());
+    for (size_t i = 0; i < dedupProbes.size(); ++i)
+        dedupProbes[i] = g.records.view(g.records.slotOf(g.columns.ids[i])).fingerprint;
+    size_t dedupBlocks = (g.columns.size() + DEDUP_TILE - 1) / DEDUP_TILE;
+    vector<DedupPair> dedupPairs;
+    record(runBench("dedup_tile", min<size_t>(16, dedupBlocks * (dedupBlocks + 1) / 2), [&](size_t t) {
+        dedupTile(g.columns, dedupProbes, t, dedupBlocks, DEDUP_TILE, 0.2, dedupPairs);
+    }));
+
+    // A template whose points all appear in a larger one is not a duplicate of
+    // it; an exact copy is
+    {
+        vector<Minutiae> full(templates[0].fingerprint.begin(), templates[0].fingerprint.end());
+        vector<Minutiae> subset(full.begin(), full.begin() + min<size_t>(3, full.size()));
+        GalleryColumns pairColumns;
+        pairColumns.append(1, subset);
+        pairColumns.append(2, full);
+        pairColumns.append(3, full);
+        vector<MinutiaeSpan> pairProbes = {subset, full, full};
+        vector<DedupPair> found;
+        dedupTile(pairColumns, pairProbes, 0, 1, DEDUP_TILE, 0.2, found);
+        if (found.size() != 1 || found[0].a != 1 || found[0].b != 2 || found[0].score != 0) {
+            printError("Dedup check failed: " + to_string(found.size()) + " pairs among a subset and two copies");
+            return 1;
         }
-        
-        logAction("Matched fingerprint with criminal ID: " + to_string(bestID));
-        addToSearchHistory("Fingerprint match with ID: " + to_string(bestID));
+        printSuccess("Dedup check: subset template rejected, exact copy found");
+    }
+
+    NullBuffer nullBuffer;
+    streambuf* saved = cout.rdbuf(&nullBuffer);
+    BenchResult bfs = runBench("network_bfs", cfg.bfsSamples, [&](size_t) {
+        showAccompliceNetwork(g.records, g.network, templates[rng.next() % templates.size()].id);
+    });
+    cout.rdbuf(saved);
+    record(bfs);
+    vector<uint32_t> order;
+    vector<int> degree;
+    record(runBench("network_walk", cfg.bfsSamples, [&](size_t) {
+        walkNetwork(g.network, g.network.vertexOf(templates[rng.next() % templates.size()].id), order, degree);
+    }));
+
+    // Graph search latency while another thread enrolls records one by one.
+    // The bench's own references are dropped first so that, as in the daemon,
+    // only in-flight searches hold old gallery versions.
+    int nextId = templates.back().id + 1;
+    templates.clear();
+    loaded.reset();
+    atomic<bool> enrolling(true);
+    size_t enrolled = 0;
+    thread writer([&]() {
+        BenchRandom wrng(cfg.seed ^ 0xE4);
+        while (enrolling) {
+            Criminal c;
+            c.id = nextId++;
+            c.name = "Enrolled " + to_string(c.id);
+            for (int n = wrng.range(cfg.minMinutiae, cfg.maxMinutiae); n > 0; --n) c.fingerprint.push_back(randomMinutia(wrng));
+            enrollCriminals(vector<Criminal>(1, c));
+            enrolled++;
+        }
+    });
+    BenchResult during = runBench("search_while_enrolling", probes.size(), [&](size_t i) {
+        shared_ptr<const Gallery> current = currentGallery();
+        sink = sink + searchGallery(*current, probes[i].second, METHOD_GRAPH, 10).hits.size();
+    });
+    enrolling = false;
+    writer.join();
+    record(during);
+    printInfo(to_string(enrolled) + " records enrolled during search_while_enrolling");
+    pollCompaction(true);
+
+    closeJournal();
+    if (!writeBenchJson(cfg.json, cfg, results)) {
+        printError("Failed to write " + cfg.json);
+        return 1;
     }
+    printSuccess("Results written to " + cfg.json);
+    return 0;
 }
+#endif
+
 // ================== MAIN FUNCTION ==================
-int main() {
+void printUsage(const char* program) {
+    cout << "Usage:\n";
+    cout << "  " << program << "                                        interactive session\n";
+    cout << "  " << program << " --convert-to-binary <in.txt> <out.bin>  migrate text database\n";
+    cout << "  " << program << " --convert-to-text <in.bin> <out.txt>    export binary gallery\n";
+    cout << "  " << program << " --compact                               fold the journal into the database\n";
+    cout << "  " << program << " --batch <probes|-> --user <name> [--method graph|zonal|cascade|indexed] [--top-k n]\n";
+    cout << "                                         search many probes, one JSON line each (password in FP_PASSWORD)\n";
+    cout << "  " << program << " --import <file|-> --user <name> [--batch-size n] [--rejects file]\n";
+    cout << "                                         bulk-enroll database-format records\n";
+    cout << "  " << program << " --dedup --user <name> [--threshold t] [--tile n] [--out file] [--checkpoint file]\n";
+    cout << "                                         cluster suspected duplicate records (resumable)\n";
+    cout << "  " << program << " --audit --user <name> [--log actions|history] [--from t] [--to t] [--by user] [--action a] [--criminal id]\n";
+    cout << "                                         query the action log or search history (t: YYYY-MM-DD[THH:MM[:SS]])\n";
+    cout << "  " << program << " --serve [socket] --user <name>         keep the gallery loaded and answer requests on a Unix socket\n";
+    cout << "  " << program << " --split-shards <n> <database> <prefix> split a gallery into n shard files by ID\n";
+    cout << "  " << program << " --coordinate [socket] --user <name> --shard <socket> ...\n";
+    cout << "                                         fan requests out to shard servers and merge their results\n";
+    cout << "Options:\n";
+    cout << "  --threads <n>         search threads (default: one per hardware thread)\n";
+    cout << "  --shortlist <n>       cascade candidates rescored by graph matching (default 200)\n";
+    cout << "  --cascade-audit <n>   check the cascade against a full graph search every nth query\n";
+    cout << "  --index-candidates <n> top-voted templates rescored in indexed mode (default 100)\n";
+    cout << "  --probe-cache <n>     search results kept for repeated probes (default 1024, 0 = off)\n";
+    cout << "  --data <prefix>       use <prefix>.bin/.txt/.journal/.tidx as the gallery (one shard's files)\n";
+    cout << "  --shard-timeout <ms>  how long the coordinator waits for a shard (default 5000)\n";
+    cout << "  --log-fsync <policy>  never, batch or interval (default: at most once a second)\n";
+    cout << "  --log-max-bytes <n>   start a new log segment past n bytes (default 16 MiB, 0 = never)\n";
+    cout << "  --log-keep <n>        log segments kept per log (default 0 = all)\n";
+}
+
+int main(int argc, char* argv[]) {
+    vector<string> args;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            searchThreads = max(0, atoi(argv[++i]));
+            continue;
+        }
+        if (arg == "--shortlist" && i + 1 < argc) {
+            cascadeShortlist = max(1, atoi(argv[++i]));
+            continue;
+        }
+        if (arg == "--index-candidates" && i + 1 < argc) {
+            indexCandidates = max(1, atoi(argv[++i]));
+            continue;
+        }
+        if (arg == "--probe-cache" && i + 1 < argc) {
+            probeCacheEntries = max(0, atoi(argv[++i]));
+            continue;
+        }
+        if (arg == "--cascade-audit" && i + 1 < argc) {
+            cascadeAuditEvery = max(0, atoi(argv[++i]));
+            continue;
+        }
+        if (arg == "--data" && i + 1 < argc) {
+            string prefix = argv[++i];
+            databaseFile = prefix + ".txt";
+            galleryFile = prefix + ".bin";
+            journalFile = prefix + ".journal";
+            tripletIndexFile = prefix + ".tidx";
+            dedupCheckpointFile = prefix + ".dedup";
+            continue;
+        }
+        if (arg == "--shard-timeout" && i + 1 < argc) {
+            shardTimeoutMs = max(1, atoi(argv[++i]));
+            continue;
+        }
+        if (arg == "--log-fsync" && i + 1 < argc) {
+            string policy = argv[++i];
+            logFsync = policy == "never" ? LOG_FSYNC_NEVER : policy == "batch" ? LOG_FSYNC_BATCH : LOG_FSYNC_INTERVAL;
+            continue;
+        }
+        if (arg == "--log-max-bytes" && i + 1 < argc) {
+            logMaxBytes = strtoull(argv[++i], nullptr, 10);
+            continue;
+        }
+        if (arg == "--log-keep" && i + 1 < argc) {
+            logKeepSegments = max(0, atoi(argv[++i]));
+            continue;
+        }
+        args.push_back(arg);
+    }
+#ifdef FINGERPRINT_BENCH
+    return runBenchmarks(args);
+#endif
+
+    if (!args.empty()) {
+        string command = args[0];
+        if ((command == "--convert-to-binary" || command == "--convert-to-text") && args.size() == 3)
+            return convertDatabase(command, args[1], args[2]);
+        if (command == "--batch")
+            return runBatch(args);
+        if (command == "--dedup")
+            return runDedup(args);
+        if (command == "--import")
+            return runImport(args);
+        if (command == "--audit")
+            return runAudit(args);
+        if (command == "--serve")
+            return runServer(args);
+        if (command == "--coordinate")
+            return runCoordinator(args);
+        if (command == "--split-shards" && args.size() == 4)
+            return splitShards(atoi(args[1].c_str()), args[2], args[3]);
+        if (command == "--compact" && args.size() == 1) {
+            loadGallery(false, false);
+            saveCriminalDB(galleryRecords(currentGallery()));
+            closeJournal();
+            printSuccess("Compacted " + to_string(currentGallery()->records.size()) + " records");
+            return 0;
+        }
+        printUsage(argv[0]);
+        return 1;
+    }
+
     // Create required files if they don't exist
     ofstream{databaseFile, ios::app};
     ofstream{credentialsFile, ios::app};
-    ofstream{logFile, ios::app};
-    ofstream{historyFile, ios::app};
 
     if (!authenticate()) return 0;
     
-    loadCriminalDB();
-    buildAccompliceGraph();
+    loadGallery();
 
     printHeader("FINGERPRINT IDENTIFICATION SYSTEM");
     cout << COLOR_GREEN << "System initialized successfully!\n";
-    cout << "- Loaded " << criminalDB.size() << " criminal records\n";
-    cout << "- Detected " << accompliceGraph.size() << " network connections\n" << COLOR_RESET;
+    cout << "- Loaded " << currentGallery()->records.size() << " criminal records\n";
+    cout << "- Detected " << currentGallery()->network.linked << " network connections\n" << COLOR_RESET;
 
     while (true) {
+        pollCompaction(false);
         cout << COLOR_BOLD << COLOR_CYAN << "\n=== MAIN MENU ===" << COLOR_RESET << "\n";
         cout << "1. Add new criminal record\n";
         cout << "2. View criminal details\n";
         cout << "3. Match fingerprint\n";
         cout << "4. View adjacency list\n";
         cout << "5. View full network\n";
-        cout << "6. View search history\n";
-        cout << "7. Exit system\n";
-        cout << COLOR_BOLD << "Enter your choice (1-7): " << COLOR_RESET;
+        cout << "6. View search history and audit log\n";
+        cout << "7. Network analytics\n";
+        cout << "8. System statistics\n";
+        cout << "9. Exit system\n";
+        cout << COLOR_BOLD << "Enter your choice (1-9): " << COLOR_RESET;
 
         int choice;
         cin >> choice;
 
+        shared_ptr<const Gallery> g = currentGallery();
         switch (choice) {
             case 1: addCriminal(); break;
             case 2: {
@@ -646,16 +6311,21 @@ int main() {
                 break;
             }
             case 3: matchFingerprint(); break;
-            case 4: viewAccomplicesAdjacencyList(); break;
+            case 4: viewAccomplicesAdjacencyList(g->records, g->network); break;
             case 5: {
                 int id;
                 cout << "Enter criminal ID to view full network: ";
                 cin >> id;
-                showAccompliceNetwork(id);
+                showAccompliceNetwork(g->records, g->network, id);
                 break;
             }
             case 6: viewSearchHistory(); break;
-            case 7: {
+            case 7: viewNetworkAnalytics(g->records, g->network); break;
+            case 8: viewStatistics(); break;
+            case 9: {
+                pollCompaction(true);
+                closeJournal();
+                dumpStatistics();
                 printSuccess("Thank you for using the system. Goodbye!");
                 return 0;
             }